@@ -0,0 +1,11 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Microbenchmarks, only built into the boot path with `make BENCH=1`
+
+void bench_vma(void);
+void bench_kmalloc(void);
+void bench_lock(void);
+void bench_run_all(void);
+
+#endif // BENCH_H
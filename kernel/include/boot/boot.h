@@ -12,6 +12,8 @@ extern struct limine_framebuffer_request framebuffer_request;
 extern struct limine_hhdm_request hhdm_request;
 extern struct limine_memmap_request memmap_request;
 extern struct limine_executable_address_request kernel_address_request;
+extern struct limine_rsdp_request rsdp_request;
+extern struct limine_mp_request mp_request;
 
 /* Public */
 extern struct flanterm_context *ft_ctx;
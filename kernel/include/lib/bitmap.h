@@ -18,4 +18,33 @@ static inline uint8_t bitmap_get(uint8_t *bitmap, uint64_t bit)
     return (bitmap[bit / 8] & (1 << (bit % 8))) != 0;
 }
 
+/* Range helpers, these do whole bytes at a time where they can */
+static inline void bitmap_set_range(uint8_t *bitmap, uint64_t start, uint64_t count)
+{
+    uint64_t end = start + count;
+    while (start < end && (start % 8) != 0)
+        bitmap_set(bitmap, start++);
+    while (start + 8 <= end)
+    {
+        bitmap[start / 8] = 0xFF;
+        start += 8;
+    }
+    while (start < end)
+        bitmap_set(bitmap, start++);
+}
+
+static inline void bitmap_clear_range(uint8_t *bitmap, uint64_t start, uint64_t count)
+{
+    uint64_t end = start + count;
+    while (start < end && (start % 8) != 0)
+        bitmap_clear(bitmap, start++);
+    while (start + 8 <= end)
+    {
+        bitmap[start / 8] = 0x00;
+        start += 8;
+    }
+    while (start < end)
+        bitmap_clear(bitmap, start++);
+}
+
 #endif // BITMAP_H
@@ -0,0 +1,46 @@
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include <lib/types.h>
+
+/*
+ * Intrusive red-black tree. The caller does the search and links the node in with rb_link, then
+ * calls rb_insert. Trees that keep per-subtree data pass an augment callback: it recomputes a
+ * node's data from its children and is called bottom-up for every node whose subtree changed.
+ */
+typedef struct rb_node
+{
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    bool red;
+} rb_node_t;
+
+typedef struct rb_root
+{
+    rb_node_t *node;
+} rb_root_t;
+
+typedef void (*rb_augment_fn)(rb_node_t *node);
+
+#define rb_entry(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define rb_entry_safe(ptr, type, member) ((ptr) ? rb_entry(ptr, type, member) : NULL)
+
+static inline void rb_link(rb_node_t *node, rb_node_t *parent, rb_node_t **link)
+{
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->red = true;
+    *link = node;
+}
+
+void rb_insert(rb_root_t *root, rb_node_t *node, rb_augment_fn augment);
+void rb_erase(rb_root_t *root, rb_node_t *node, rb_augment_fn augment);
+void rb_propagate(rb_node_t *node, rb_augment_fn augment);
+
+rb_node_t *rb_first(rb_root_t *root);
+rb_node_t *rb_last(rb_root_t *root);
+rb_node_t *rb_next(rb_node_t *node);
+rb_node_t *rb_prev(rb_node_t *node);
+
+#endif // RBTREE_H
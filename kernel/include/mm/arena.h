@@ -0,0 +1,73 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <lib/types.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_DEFAULT_CHUNK 0x10000 // 64 KiB, reserved lazily so only touched pages cost memory
+
+/*
+ * Bump allocator for objects that all die together. Nothing is freed on its own: arena_restore
+ * drops everything allocated since a mark, arena_reset drops everything, and the chunks stay
+ * around for the next round until arena_destroy. An arena belongs to one owner, it doesn't lock.
+ */
+typedef struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t size; // bytes, this header included
+} arena_chunk_t;
+
+typedef struct arena
+{
+    arena_chunk_t *first;
+    arena_chunk_t *chunk; // the one being bumped, NULL before the first allocation
+    uintptr_t ptr;
+    uintptr_t end;
+    size_t chunk_size;
+} arena_t;
+
+typedef struct arena_mark
+{
+    arena_chunk_t *chunk;
+    uintptr_t ptr;
+} arena_mark_t;
+
+void arena_init(arena_t *arena, size_t chunk_size);
+void arena_destroy(arena_t *arena);
+void *arena_grow(arena_t *arena, size_t size, size_t align);
+
+static inline void *arena_alloc_aligned(arena_t *arena, size_t size, size_t align)
+{
+    uintptr_t p = (arena->ptr + align - 1) & ~(uintptr_t)(align - 1);
+    if (arena->chunk && p <= arena->end && size <= arena->end - p)
+    {
+        arena->ptr = p + size;
+        return (void *)p;
+    }
+    return arena_grow(arena, size, align);
+}
+
+static inline void *arena_alloc(arena_t *arena, size_t size)
+{
+    return arena_alloc_aligned(arena, size, ARENA_ALIGN);
+}
+
+/* Nested scopes: everything allocated after a save goes away on the matching restore */
+static inline arena_mark_t arena_save(arena_t *arena)
+{
+    return (arena_mark_t){arena->chunk, arena->ptr};
+}
+
+static inline void arena_restore(arena_t *arena, arena_mark_t mark)
+{
+    arena->chunk = mark.chunk;
+    arena->ptr = mark.ptr;
+    arena->end = mark.chunk ? (uintptr_t)mark.chunk + mark.chunk->size : 0;
+}
+
+static inline void arena_reset(arena_t *arena)
+{
+    arena_restore(arena, (arena_mark_t){NULL, 0});
+}
+
+#endif // ARENA_H
@@ -1,27 +1,41 @@
-// Copyright: Durand Miller <clutter@djm.co.za>
-#ifndef LIBALLOC_H
-#define LIBALLOC_H
+#ifndef KMALLOC_H
+#define KMALLOC_H
 
-#include <stddef.h>
-#include <stdint.h>
-#include <util/log.h>
+#include <lib/types.h>
 
-#define PREFIX(func) k##func
+/* Requests up to this size come from the size-class slabs, bigger ones get a span of whole pages */
+#define KMALLOC_MAX_SMALL 4096
 
-#ifdef _DEBUG
-void liballoc_dump();
-#endif // _DEBUG
+#define KMALLOC_GROW_PAGES 32     // spans smaller than this are fetched from the source in batches this big
+#define KMALLOC_CACHE_BINS 32     // freed spans up to this many pages are kept for reuse...
+#define KMALLOC_CACHE_PAGES 512   // ...up to this many pages in total
+#define KMALLOC_TRIM_PASSES 200   // idle passes without span traffic before the cache is handed back
 
-extern int liballoc_lock();
-extern int liballoc_unlock();
-extern void *liballoc_alloc(size_t);
-extern int liballoc_free(void *, size_t);
+/* Where the heap gets its spans from */
+typedef struct kmalloc_source
+{
+    const char *name;
+    void *(*alloc)(size_t pages); // kernel virtual, page aligned, mapped
+    void (*free)(void *ptr, size_t pages);
+    bool split; // any whole-page piece of a span can be freed on its own, needed for batching
+} kmalloc_source_t;
 
-extern void *PREFIX(malloc)(size_t);
-extern void *PREFIX(realloc)(void *, size_t);
-extern void *PREFIX(calloc)(size_t, size_t);
-extern void PREFIX(free)(void *);
+extern const kmalloc_source_t kmalloc_pmm_source; // HHDM, physically contiguous, the default
+extern const kmalloc_source_t kmalloc_vma_source; // regions in the kernel VMA context
 
-#define heap_log(...) (void)0
+void kmalloc_init(void);
+bool kmalloc_set_source(const kmalloc_source_t *source);
+void kmalloc_trim(void);
+void *kmalloc(size_t size);
+void *krealloc(void *ptr, size_t size);
+void *kcalloc(size_t count, size_t size);
+void kfree(void *ptr);
 
-#endif // LIBALLOC_H
\ No newline at end of file
+#ifdef GENOA_KMALLOC_PROFILE
+/* Allocation profiler, built with `make KMALLOC_PROFILE=1` */
+void kmalloc_profile_alloc(void *ptr, size_t size, void *site);
+void kmalloc_profile_free(void *ptr);
+void kmalloc_profile_dump(void);
+#endif
+
+#endif // KMALLOC_H
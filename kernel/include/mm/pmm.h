@@ -3,10 +3,85 @@
 
 #include <lib/types.h>
 
+/* Largest buddy block is 2^PMM_MAX_ORDER pages (1 GiB) */
+#define PMM_MAX_ORDER 18
+
+/* Address limits for pmm_alloc_contig */
+#define PMM_DMA_LIMIT 0x1000000ULL    // 16 MiB, legacy ISA DMA
+#define PMM_DMA32_LIMIT 0x100000000ULL // 4 GiB, 32-bit DMA
+
+/* log2(PAGE_SIZE), boot.h pulls this header in before util/memory.h is done */
+#define PMM_PAGE_SHIFT 12
+
+/* Page descriptor flags */
+#define PG_TABLE BIT(0)    // page table page, table_used is valid
+#define PG_SLAB BIT(1)     // part of a slab, slab_cache is valid
+#define PG_HEAP BIT(2)     // first page of a large kmalloc span, span_pages is valid
+#define PG_MAGAZINE BIT(3) // sitting in a per-CPU magazine, still marked used in the bitmap
+#define PG_RAM BIT(4)      // usable RAM the PMM manages, everything else below the top is MMIO or firmware
+
+/* One per physical page, indexed by PFN. Kept at 32 bytes so two share a cache line */
+typedef struct page
+{
+    struct page *next; // free list or owner list linkage
+    struct page *prev;
+    uint32_t refs;     // extra owners of a shared page, 0 when there's just one
+    uint16_t flags;
+    uint8_t order; // order + 1 on the first page of a free buddy block, 0 otherwise
+    uint8_t node;
+    union
+    {
+        uint64_t private;    // whatever the owner wants
+        uint16_t table_used; // PG_TABLE: present entries
+        void *slab_cache;    // PG_SLAB: the cache owning this page
+        uint64_t span_pages; // PG_HEAP: length of the span
+    };
+} page_t;
+
+extern page_t *pmm_pages;
+extern uint64_t bitmap_pages;
+
+static inline page_t *pmm_phys_to_page(uint64_t phys)
+{
+    uint64_t pfn = phys >> PMM_PAGE_SHIFT;
+    return pfn < bitmap_pages ? &pmm_pages[pfn] : NULL;
+}
+
+static inline uint64_t pmm_page_to_phys(page_t *page)
+{
+    return (uint64_t)(page - pmm_pages) << PMM_PAGE_SHIFT;
+}
+
+/* Per-CPU single-page magazine counters */
+typedef struct pmm_cpu_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refills;
+    uint64_t drains;
+    uint64_t zero_hits;   // pmm_request_zeroed_page served from the zero pool
+    uint64_t zero_misses; // ... or cleared inline
+} pmm_cpu_stats_t;
+
 void pmm_init();
+void pmm_numa_init(void);
 void *pmm_request_pages(size_t pages, bool higher_half);
+void *pmm_request_pages_node(size_t pages, bool higher_half, uint32_t node);
+void *pmm_alloc_contig(size_t pages, size_t align, uint64_t max_phys);
 void pmm_release_pages(void *ptr, size_t pages);
+void *pmm_request_zeroed_page(void);
+void pmm_zero_worker(void);
+void pmm_page_ref(uint64_t phys);
+bool pmm_page_unref(uint64_t phys);
+bool pmm_page_shared(uint64_t phys);
+bool pmm_is_ram(uint64_t phys);
+uint64_t pmm_get_free_pages(void);
+uint64_t pmm_get_total_pages(void);
+void pmm_get_metadata(uint64_t *base, uint64_t *length);
+void pmm_get_cpu_stats(uint32_t cpu, pmm_cpu_stats_t *out);
+void pmm_dump_cpu_stats(void);
+void pmm_dump_zones(void);
 
 #define pmm_request_page() pmm_request_pages(1, false)
 
-#endif // PMM_H
\ No newline at end of file
+#endif // PMM_H
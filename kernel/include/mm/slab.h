@@ -0,0 +1,20 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <lib/types.h>
+
+typedef struct slab_cache slab_cache_t;
+typedef void (*slab_ctor_t)(void *obj);
+
+/*
+ * Object caches for fixed-size kernel structures. A constructor, if given, runs once when a slab
+ * is created; objects go back to the cache still constructed, so freed objects should be left
+ * in that state.
+ */
+slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align, slab_ctor_t ctor);
+void *slab_alloc(slab_cache_t *cache);
+void slab_free(slab_cache_t *cache, void *obj);
+size_t slab_cache_size(slab_cache_t *cache);
+void slab_dump_caches(void);
+
+#endif // SLAB_H
@@ -0,0 +1,32 @@
+#ifndef TLB_H
+#define TLB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TLB_SHOOTDOWN_VECTOR 0xF0
+
+/* Above this many pages a flush reloads CR3 instead of issuing invlpg per page */
+#define TLB_FLUSH_THRESHOLD 32
+
+typedef struct
+{
+    uint64_t ipis_sent;
+    uint64_t ipis_received;
+    uint64_t pages_flushed;
+    uint64_t full_flushes;
+    uint64_t lazy_skips; // remote CPUs not IPI'd because they weren't running the pagemap
+    uint64_t switches;
+    uint64_t switches_kept; // pagemap switches that kept the TLB thanks to PCIDs
+} tlb_stats_t;
+
+void tlb_cpu_setup();
+void tlb_init();
+void tlb_register_cpu(uint32_t cpu, uint32_t lapic_id);
+uint64_t tlb_switch_pagemap(uint64_t *pagemap);
+void tlb_shootdown(uint64_t *pagemap, uint64_t virt, uint64_t pages);
+void tlb_poll(void);
+bool tlb_get_stats(uint32_t cpu, tlb_stats_t *out);
+void tlb_dump_stats();
+
+#endif // TLB_H
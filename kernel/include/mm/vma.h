@@ -3,26 +3,49 @@
 
 #include <mm/vmm.h>
 #include <mm/pmm.h>
+#include <lib/rbtree.h>
 #include <stdint.h>
+#include <sys/rcu.h>
+#include <sys/rwlock.h>
+#include <sys/seqlock.h>
+
+// Only reserve the range, pages get backed by the page fault handler on first touch
+#define VMA_LAZY BIT(9)
 
 typedef struct vma_region
 {
     uint64_t start;
     uint64_t pages;
     uint64_t flags;
-    struct vma_region *next;
-    struct vma_region *prev;
+    uint64_t gap;     // free bytes between the previous region (or the context base) and this one
+    uint64_t max_gap; // largest gap in this subtree
+    rb_node_t node;
+    bool dead;        // being freed, faults must leave it alone
+    rcu_head_t rcu;
 } vma_region_t;
 
+/*
+ * `lock` serializes changes to the region tree: alloc, free and destroy write it, fork reads it.
+ * Taken with interrupts on, holders may wait on a TLB shootdown. Faults and vma_find_region don't
+ * take it at all: regions are freed through RCU and `seq` tells a lookup that raced a rebalance to
+ * try again.
+ */
 typedef struct vma_context
 {
     uint64_t *pagemap;
-    vma_region_t *root;
+    rb_root_t regions;
+    uint64_t base;
+    uint64_t limit;
+    rwlock_t lock;
+    seqcount_t seq;
 } vma_context_t;
 
+void vma_init();
 vma_context_t *vma_create_context(uint64_t *pagemap);
 void vma_destroy_context(vma_context_t *ctx);
+vma_context_t *vma_fork_context(vma_context_t *ctx);
 void *vma_alloc(vma_context_t *ctx, uint64_t pages, uint64_t flags);
 void vma_free(vma_context_t *ctx, void *ptr);
+vma_region_t *vma_find_region(vma_context_t *ctx, uint64_t addr); // caller holds ctx->lock or rcu_read_lock
 
 #endif // VMA_H
\ No newline at end of file
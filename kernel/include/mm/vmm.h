@@ -2,13 +2,23 @@
 #define VMM_H
 
 #include <lib/types.h>
+#include <sys/rcu.h>
+#include <sys/rwlock.h>
 #include <util/memory.h>
 
 #define VMM_PRESENT BIT(0)
 #define VMM_WRITE BIT(1)
 #define VMM_USER BIT(2)
+#define VMM_PWT BIT(3)
+#define VMM_PCD BIT(4)
+#define VMM_HUGE BIT(7) // PS bit, only valid in PML3/PML2 entries
+#define VMM_GLOBAL BIT(8)
+#define VMM_COW BIT(10) // available-to-software bit, read-only because the page is shared with a clone
 #define VMM_NX BIT(63)
 
+#define PAGE_SIZE_2M 0x200000ULL
+#define PAGE_SIZE_1G 0x40000000ULL
+
 #define PAGE_MASK 0x000FFFFFFFFFF000ULL
 #define PAGE_INDEX_MASK 0x1FF
 
@@ -17,14 +27,40 @@
 #define PML3_SHIFT 30
 #define PML4_SHIFT 39
 
+#define VMM_KERNEL_HALF 0xFFFF800000000000ULL
+
+// Free lower-half page tables that become empty on unmap (kernel-half ones are always kept, every PCID walks them)
+#define VMM_RECLAIM_TABLES 1
+
+/* Per-pagemap bookkeeping, looked up by the PML4's physical address */
+typedef struct vmm_pagemap_meta
+{
+    uint64_t pml4;
+    struct vmm_pagemap_meta *next;
+    uint16_t pcid;
+    uint64_t pcid_gen;
+    uint64_t stale_cpus; // CPUs that may hold stale entries tagged with this PCID
+    struct vma_context *vma;
+    rwlock_t lock;        // page table structure, kernel-half addresses use kernel_pagemap's
+    uint32_t cow_flushes; // clones still shooting down their write-protect, COW faults wait for them
+    rcu_head_t rcu;
+} vmm_pagemap_meta_t;
+
 extern uint64_t *kernel_pagemap;
 
 void vmm_init();
 void vmm_switch_pagemap(uint64_t *pagemap);
 uint64_t *vmm_new_pagemap();
-void vmm_map(uint64_t *pagemap, uint64_t virt, uint64_t phys, uint64_t flags);
+bool vmm_map(uint64_t *pagemap, uint64_t virt, uint64_t phys, uint64_t flags);
+bool vmm_map_size(uint64_t *pagemap, uint64_t virt, uint64_t phys, uint64_t flags, uint64_t size);
+int vmm_map_if_unmapped(uint64_t *pagemap, uint64_t virt, uint64_t phys, uint64_t flags);
 void vmm_unmap(uint64_t *pagemap, uint64_t virt);
+bool vmm_map_range(uint64_t *pagemap, uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags);
+void vmm_unmap_range(uint64_t *pagemap, uint64_t virt, uint64_t size);
 uint64_t virt_to_phys(uint64_t *pagemap, uint64_t virt);
 void vmm_destroy_pagemap(uint64_t *pagemap);
+uint64_t *vmm_clone_pagemap(uint64_t *pagemap);
+bool vmm_handle_cow(uint64_t *pagemap, uint64_t virt);
+vmm_pagemap_meta_t *vmm_pagemap_meta(uint64_t *pagemap);
 
 #endif // VMM_H
\ No newline at end of file
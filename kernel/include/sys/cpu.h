@@ -1,7 +1,90 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <stdint.h>
+
+/* Upper bound on the number of CPUs per-CPU structures are sized for */
+#define CPU_MAX 64
+
 [[noreturn]] void hlt();
 [[noreturn]] void hcf();
 
-#endif // CPU_H
\ No newline at end of file
+/* Where cpu_local_t keeps the id, see sys/smp.h */
+#define CPU_LOCAL_ID_OFFSET 8
+
+/* Read from the GS-based per-CPU area, smp_bsp_init() points GS at it before anything calls this */
+static inline uint32_t cpu_current_id(void)
+{
+    uint32_t id;
+    __asm__("movl %%gs:%c1, %0" : "=r"(id) : "i"(CPU_LOCAL_ID_OFFSET));
+    return id;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    __asm__ volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(subleaf));
+}
+
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value)
+{
+    __asm__ volatile("wrmsr" ::"c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline uint64_t read_cr3(void)
+{
+    uint64_t cr3;
+    __asm__ volatile("movq %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
+static inline void write_cr3(uint64_t cr3)
+{
+    __asm__ volatile("movq %0, %%cr3" ::"r"(cr3) : "memory");
+}
+
+static inline uint64_t read_cr4(void)
+{
+    uint64_t cr4;
+    __asm__ volatile("movq %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint64_t cr4)
+{
+    __asm__ volatile("movq %0, %%cr4" ::"r"(cr4) : "memory");
+}
+
+static inline void invlpg(uint64_t virt)
+{
+    __asm__ volatile("invlpg (%0)" ::"r"(virt) : "memory");
+}
+
+/* Local interrupt state, for per-CPU data that must not be touched from an interrupt handler mid-update */
+static inline uint64_t int_save_disable(void)
+{
+    uint64_t flags;
+    __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void int_restore(uint64_t flags)
+{
+    if (flags & (1 << 9))
+        __asm__ volatile("sti" ::: "memory");
+}
+
+#endif // CPU_H
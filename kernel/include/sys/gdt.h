@@ -24,6 +24,10 @@
 #define GDT_USER_DATA (GDT_ACCESS_PRESENT | GDT_ACCESS_RING3 | GDT_ACCESS_DATA | GDT_ACCESS_RW)
 #define GDT_TSS 0xE9
 
+// Layout: null, kernel code/data, user code/data, then the 16 byte TSS descriptor
+#define GDT_ENTRIES 7
+#define GDT_TSS_SELECTOR 0x28
+
 // Granularity Flags
 #define GDT_GRANULARITY_4K 0x80
 #define GDT_GRANULARITY_32B 0x40
@@ -77,9 +81,7 @@ typedef struct tss_entry
     uint16_t io_map_base;
 } __attribute__((packed)) tss_entry_t;
 
-extern gdt_ptr_t gdt_ptr;
-
-void gdt_init();
+void gdt_init(gdt_entry_t *gdt, tss_entry_t *tss);
 void gdt_flush(gdt_ptr_t gdt_ptr);
 
 #endif // GDT_H
\ No newline at end of file
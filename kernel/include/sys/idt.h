@@ -34,7 +34,9 @@ typedef void (*idt_intr_handler)(struct register_ctx *ctx);
 void idt_init();
 void load_idt();
 int idt_register_handler(size_t vector, idt_intr_handler handler);
+int idt_unregister_handler(size_t vector, idt_intr_handler handler);
 void idt_default_interrupt_handler(struct register_ctx *ctx);
+void idt_dispatch(struct register_ctx *ctx);
 void kpanic(struct register_ctx *ctx, const char *fmt, ...);
 
 #endif // IDT_H
\ No newline at end of file
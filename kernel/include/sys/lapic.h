@@ -0,0 +1,14 @@
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <stdint.h>
+
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+void lapic_init();
+void lapic_init_cpu();
+uint32_t lapic_id();
+void lapic_eoi();
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector);
+
+#endif // LAPIC_H
@@ -0,0 +1,25 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <lib/types.h>
+
+#define NUMA_MAX_NODES 16
+#define NUMA_MAX_RANGES 32
+
+typedef struct numa_memory_range
+{
+    uint64_t base;
+    uint64_t length;
+    uint32_t node;
+} numa_memory_range_t;
+
+/* Parses the SRAT, without one everything is node 0 */
+void numa_init(void);
+void numa_register_cpu(uint32_t cpu, uint32_t lapic_id);
+
+uint32_t numa_node_count(void);
+uint32_t numa_range_count(void);
+const numa_memory_range_t *numa_get_range(uint32_t index);
+uint32_t numa_node_of_cpu(uint32_t cpu);
+
+#endif // NUMA_H
@@ -0,0 +1,58 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/smp.h>
+
+/*
+ * Read-copy-update. Readers bracket their lookups with rcu_read_lock/unlock, which only bump a
+ * per-CPU counter. Writers unpublish an object, then free it from a call_rcu callback (or after
+ * synchronize_rcu) once every CPU has passed a quiescent state: the timer tick landing outside a
+ * read-side section, the idle loop, or an AP finishing its smp_call work. Nothing here sleeps or
+ * gets preempted, so readers must not block either.
+ *
+ * Hardware interrupt handlers run with interrupts off and no tick can land inside one, so they
+ * are read-side sections without taking the lock. Exceptions keep the interrupted IF and are
+ * wrapped by idt_dispatch.
+ */
+typedef struct rcu_head
+{
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+} rcu_head_t;
+
+#define rcu_entry(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/* Publishing and reading pointers to RCU-protected objects */
+#define rcu_assign_pointer(ptr, value) __atomic_store_n(&(ptr), (value), __ATOMIC_RELEASE)
+#define rcu_dereference(ptr) __atomic_load_n(&(ptr), __ATOMIC_CONSUME)
+
+/* Interrupts only ever leave the count as they found it, so the plain increment is fine */
+static inline void rcu_read_lock(void)
+{
+    cpu_local()->rcu_nesting++;
+    __asm__ volatile("" ::: "memory");
+}
+
+static inline void rcu_read_unlock(void)
+{
+    __asm__ volatile("" ::: "memory");
+    cpu_local()->rcu_nesting--;
+}
+
+void call_rcu(rcu_head_t *head, void (*func)(rcu_head_t *head));
+void synchronize_rcu(void); // not from a read-side section or with interrupts off
+void rcu_process_callbacks(void);
+bool rcu_callbacks_ready(void);
+
+/* Quiescent-state reporting, for the tick, the idle loops and idt_dispatch */
+void rcu_qs(void);
+void rcu_tick(void);
+void rcu_idle_enter(void);
+void rcu_idle_exit(void);
+bool rcu_irq_enter(void);
+void rcu_irq_exit(bool was_idle);
+
+#endif // RCU_H
@@ -0,0 +1,97 @@
+#ifndef RWLOCK_H
+#define RWLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/spinlock.h>
+
+/*
+ * Queued reader-writer lock. One word holds the reader count and the writer state, so an
+ * uncontended read or write acquire is a single atomic. Anyone who has to wait lines up on `wait`,
+ * which keeps waiters in FIFO order and stops a stream of readers from starving a writer: once a
+ * writer is waiting, new readers queue behind it.
+ *
+ * Readers inside an interrupt handler skip the queue and only wait for an active writer, since the
+ * code they interrupted may be holding a read lock the queued writer is waiting on. Writers whose
+ * lock is read from interrupts must therefore use the irqsave variants.
+ */
+#define RWLOCK_WRITER_LOCKED 0xFF
+#define RWLOCK_WRITER_WAITING 0x100
+#define RWLOCK_WRITER_MASK (RWLOCK_WRITER_LOCKED | RWLOCK_WRITER_WAITING)
+#define RWLOCK_READER 0x200 // one reader, the count lives above the writer bits
+
+typedef struct
+{
+    volatile uint32_t cnts;
+    spinlock_t wait;
+#ifdef GENOA_LOCK_DEBUG
+    uint8_t debug; // only writers are tracked, readers may nest with interrupts either way
+#endif
+} rwlock_t;
+
+void rwlock_read_acquire_slow(rwlock_t *lock, uint32_t cnts);
+void rwlock_write_acquire_slow(rwlock_t *lock);
+
+static inline void rwlock_init(rwlock_t *lock)
+{
+    lock->cnts = 0;
+    spinlock_init(&lock->wait);
+}
+
+static inline void rwlock_read_acquire(rwlock_t *lock)
+{
+    uint32_t cnts = __atomic_add_fetch(&lock->cnts, RWLOCK_READER, __ATOMIC_ACQUIRE);
+    if (cnts & RWLOCK_WRITER_MASK)
+        rwlock_read_acquire_slow(lock, cnts);
+}
+
+static inline void rwlock_read_release(rwlock_t *lock)
+{
+    __atomic_sub_fetch(&lock->cnts, RWLOCK_READER, __ATOMIC_RELEASE);
+}
+
+static inline void rwlock_write_acquire(rwlock_t *lock)
+{
+    LOCK_DEBUG_ACQUIRE(lock, NULL);
+    uint32_t cnts = 0;
+    if (!__atomic_compare_exchange_n(&lock->cnts, &cnts, RWLOCK_WRITER_LOCKED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        rwlock_write_acquire_slow(lock);
+}
+
+static inline void rwlock_write_release(rwlock_t *lock)
+{
+    __atomic_sub_fetch(&lock->cnts, RWLOCK_WRITER_LOCKED, __ATOMIC_RELEASE);
+}
+
+static inline bool rwlock_write_held(rwlock_t *lock)
+{
+    return (__atomic_load_n(&lock->cnts, __ATOMIC_RELAXED) & RWLOCK_WRITER_LOCKED) != 0;
+}
+
+static inline uint64_t rwlock_read_acquire_irqsave(rwlock_t *lock)
+{
+    uint64_t flags = int_save_disable();
+    rwlock_read_acquire(lock);
+    return flags;
+}
+
+static inline void rwlock_read_release_irqrestore(rwlock_t *lock, uint64_t flags)
+{
+    rwlock_read_release(lock);
+    int_restore(flags);
+}
+
+static inline uint64_t rwlock_write_acquire_irqsave(rwlock_t *lock)
+{
+    uint64_t flags = int_save_disable();
+    rwlock_write_acquire(lock);
+    return flags;
+}
+
+static inline void rwlock_write_release_irqrestore(rwlock_t *lock, uint64_t flags)
+{
+    rwlock_write_release(lock);
+    int_restore(flags);
+}
+
+#endif // RWLOCK_H
@@ -0,0 +1,113 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/spinlock.h>
+
+/*
+ * Sequence counter: writers bump it to odd before touching the data and back to even after,
+ * readers copy the data out and retry if the count moved under them. Readers never write shared
+ * memory, so any number of them can run at once without bouncing a cache line. Writers have to
+ * be serialized by something else, seqlock_t below bundles a spinlock for that.
+ *
+ *     do {
+ *         seq = seqcount_read_begin(&counter);
+ *         copy = data;
+ *     } while (seqcount_read_retry(&counter, seq));
+ *
+ * Only for plain data that can be copied out: a reader may see a torn value before retrying, so
+ * it must never follow a pointer it read inside the loop.
+ */
+typedef struct
+{
+    volatile uint32_t seq;
+} seqcount_t;
+
+static inline void seqcount_init(seqcount_t *counter)
+{
+    counter->seq = 0;
+}
+
+static inline uint32_t seqcount_read_begin(seqcount_t *counter)
+{
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&counter->seq, __ATOMIC_ACQUIRE)) & 1)
+    {
+        asm volatile("pause" ::: "memory");
+    }
+    return seq;
+}
+
+static inline bool seqcount_read_retry(seqcount_t *counter, uint32_t seq)
+{
+    /* Keeps the data loads above from sinking below the re-read */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&counter->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void seqcount_write_begin(seqcount_t *counter)
+{
+    __atomic_store_n(&counter->seq, counter->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqcount_write_end(seqcount_t *counter)
+{
+    __atomic_store_n(&counter->seq, counter->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Sequence counter plus the spinlock that serializes its writers */
+typedef struct
+{
+    seqcount_t count;
+    spinlock_t lock;
+} seqlock_t;
+
+static inline void seqlock_init(seqlock_t *seqlock)
+{
+    seqcount_init(&seqlock->count);
+    spinlock_init(&seqlock->lock);
+}
+
+static inline uint32_t seqlock_read_begin(seqlock_t *seqlock)
+{
+    return seqcount_read_begin(&seqlock->count);
+}
+
+static inline bool seqlock_read_retry(seqlock_t *seqlock, uint32_t seq)
+{
+    return seqcount_read_retry(&seqlock->count, seq);
+}
+
+static inline void seqlock_write_acquire(seqlock_t *seqlock)
+{
+    spinlock_acquire(&seqlock->lock);
+    seqcount_write_begin(&seqlock->count);
+}
+
+static inline void seqlock_write_release(seqlock_t *seqlock)
+{
+    seqcount_write_end(&seqlock->count);
+    spinlock_release(&seqlock->lock);
+}
+
+/*
+ * Readers spin while the count is odd, so a reader in an interrupt handler that lands on top of a
+ * writer on the same core would spin forever. Writers whose data is read from interrupts must use
+ * these.
+ */
+static inline uint64_t seqlock_write_acquire_irqsave(seqlock_t *seqlock)
+{
+    uint64_t flags = int_save_disable();
+    seqlock_write_acquire(seqlock);
+    return flags;
+}
+
+static inline void seqlock_write_release_irqrestore(seqlock_t *seqlock, uint64_t flags)
+{
+    seqlock_write_release(seqlock);
+    int_restore(flags);
+}
+
+#endif // SEQLOCK_H
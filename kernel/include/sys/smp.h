@@ -0,0 +1,53 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/cpu.h>
+#include <sys/gdt.h>
+
+/* AP kernel stacks, same 16 KiB the BSP gets from Limine */
+#define SMP_STACK_PAGES 4
+
+/* Kicks an AP out of hlt so it looks at its work slot */
+#define SMP_WAKE_VECTOR 0xF1
+
+typedef void (*smp_work_t)(void *arg);
+
+/* Per-CPU area, IA32_GS_BASE points at the running CPU's copy */
+typedef struct cpu_local
+{
+    struct cpu_local *self; // %gs:0, so cpu_local() doesn't need an MSR read
+    uint32_t id;            // %gs:8, dense, the BSP is always 0
+    uint32_t lapic_id;
+    uint32_t node;
+    bool online;
+    uint32_t irq_depth;   // nested hardware interrupt handlers, bumped by idt_dispatch
+    uint32_t rcu_nesting; // rcu_read_lock depth
+    bool rcu_idle;        // in the idle loop, grace periods don't wait for this CPU
+    uint64_t stack_top;
+    smp_work_t work; // picked up by the AP's idle loop, cleared once it starts running
+    void *work_arg;
+    gdt_entry_t gdt[GDT_ENTRIES] __attribute__((aligned(16)));
+    tss_entry_t tss __attribute__((aligned(16)));
+} cpu_local_t;
+
+static inline cpu_local_t *cpu_local(void)
+{
+    cpu_local_t *local;
+    __asm__("movq %%gs:0, %0" : "=r"(local));
+    return local;
+}
+
+static inline bool cpu_in_irq(void)
+{
+    return cpu_local()->irq_depth != 0;
+}
+
+void smp_bsp_init(uint64_t stack_top);
+void smp_init();
+uint32_t smp_cpu_count();
+cpu_local_t *smp_cpu(uint32_t id);
+bool smp_call(uint32_t id, smp_work_t work, void *arg);
+
+#endif // SMP_H
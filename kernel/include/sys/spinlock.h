@@ -2,21 +2,47 @@
 #define SPINLOCK_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/cpu.h>
 
+/*
+ * make LOCK_DEBUG=1 remembers, per lock, whether it was ever taken inside an interrupt handler and
+ * whether it was ever taken with interrupts enabled. A lock that sees both can deadlock against
+ * itself on one core, the first time that happens it gets reported with the call site.
+ */
+#ifdef GENOA_LOCK_DEBUG
+void lock_debug_acquire(uint8_t *state, void *lock, void *site); // NULL site: whoever called this
+#define LOCK_DEBUG_ACQUIRE(lock, site) lock_debug_acquire(&(lock)->debug, (lock), (site))
+#else
+#define LOCK_DEBUG_ACQUIRE(lock, site) ((void)0)
+#endif
+
+/*
+ * Ticket lock: take a number, wait for it to be served. FIFO, so no core can starve the others,
+ * but all waiters still poll `owner`. Fine for the short, lightly contended locks that make up
+ * most of the kernel, hot global locks should use mcs_lock_t instead.
+ */
 typedef struct
 {
-    volatile uint32_t lock; // 0 = unlocked, 1 = locked
+    volatile uint32_t next;  // next ticket to hand out
+    volatile uint32_t owner; // ticket currently allowed in
+#ifdef GENOA_LOCK_DEBUG
+    uint8_t debug;
+#endif
 } spinlock_t;
 
 static inline void spinlock_init(spinlock_t *lock)
 {
-    lock->lock = 0;
+    lock->next = 0;
+    lock->owner = 0;
 }
 
 static inline void spinlock_acquire(spinlock_t *lock)
 {
-    while (__atomic_test_and_set(&lock->lock, __ATOMIC_ACQUIRE))
+    LOCK_DEBUG_ACQUIRE(lock, NULL);
+    uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
     {
         asm volatile("pause" ::: "memory");
     }
@@ -24,17 +50,153 @@ static inline void spinlock_acquire(spinlock_t *lock)
 
 static inline void spinlock_release(spinlock_t *lock)
 {
-    __atomic_clear(&lock->lock, __ATOMIC_RELEASE);
+    /* Only the holder writes owner, no RMW needed */
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
 }
 
 static inline bool spinlock_try_acquire(spinlock_t *lock)
 {
-    return !__atomic_test_and_set(&lock->lock, __ATOMIC_ACQUIRE);
+    LOCK_DEBUG_ACQUIRE(lock, NULL);
+    uint32_t ticket = __atomic_load_n(&lock->next, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&lock->owner, __ATOMIC_RELAXED) != ticket)
+        return false;
+    return __atomic_compare_exchange_n(&lock->next, &ticket, ticket + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
 }
 
 static inline bool spinlock_held(spinlock_t *lock)
 {
-    return __atomic_load_n(&lock->lock, __ATOMIC_RELAXED) != 0;
+    return __atomic_load_n(&lock->next, __ATOMIC_RELAXED) != __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+}
+
+/*
+ * MCS queued lock: waiters line up in a list and each spins on its own node, so a handoff only
+ * moves one cache line between two cores no matter how many are waiting. Nodes come from a small
+ * per-CPU pool, one per nesting level (process, interrupt, ...), which keeps the API the same as
+ * spinlock_t. Releases don't have to be in acquire order.
+ */
+#define MCS_NODES_PER_CPU 4
+
+typedef struct mcs_node
+{
+    struct mcs_node *next;
+    volatile uint32_t locked;
+} __attribute__((aligned(64))) mcs_node_t;
+
+typedef struct
+{
+    mcs_node_t *tail;  // last waiter, NULL when free
+    mcs_node_t *owner; // holder's node, only touched by the holder
+#ifdef GENOA_LOCK_DEBUG
+    uint8_t debug;
+#endif
+} mcs_lock_t;
+
+static inline void mcs_lock_init(mcs_lock_t *lock)
+{
+    lock->tail = NULL;
+    lock->owner = NULL;
+}
+
+void mcs_lock_acquire(mcs_lock_t *lock);
+void mcs_lock_release(mcs_lock_t *lock);
+bool mcs_lock_try_acquire(mcs_lock_t *lock);
+
+static inline bool mcs_lock_held(mcs_lock_t *lock)
+{
+    return __atomic_load_n(&lock->tail, __ATOMIC_RELAXED) != NULL;
 }
 
-#endif // SPINLOCK_H
\ No newline at end of file
+/*
+ * Interrupt-safe variants: local interrupts stay off while the lock is held, so a handler on the
+ * same core can never spin on a lock its own interrupted code holds. Use these for anything an
+ * interrupt handler may take.
+ */
+static inline uint64_t spinlock_acquire_irqsave(spinlock_t *lock)
+{
+    uint64_t flags = int_save_disable();
+    spinlock_acquire(lock);
+    return flags;
+}
+
+static inline void spinlock_release_irqrestore(spinlock_t *lock, uint64_t flags)
+{
+    spinlock_release(lock);
+    int_restore(flags);
+}
+
+static inline bool spinlock_try_acquire_irqsave(spinlock_t *lock, uint64_t *flags)
+{
+    *flags = int_save_disable();
+    if (spinlock_try_acquire(lock))
+        return true;
+    int_restore(*flags);
+    return false;
+}
+
+static inline uint64_t mcs_lock_acquire_irqsave(mcs_lock_t *lock)
+{
+    uint64_t flags = int_save_disable();
+    mcs_lock_acquire(lock);
+    return flags;
+}
+
+static inline void mcs_lock_release_irqrestore(mcs_lock_t *lock, uint64_t flags)
+{
+    mcs_lock_release(lock);
+    int_restore(flags);
+}
+
+static inline bool mcs_lock_try_acquire_irqsave(mcs_lock_t *lock, uint64_t *flags)
+{
+    *flags = int_save_disable();
+    if (mcs_lock_try_acquire(lock))
+        return true;
+    int_restore(*flags);
+    return false;
+}
+
+/* Scope guards: the lock is taken irqsave and dropped when the guard goes out of scope */
+typedef struct
+{
+    spinlock_t *lock;
+    uint64_t flags;
+} spinlock_guard_t;
+
+typedef struct
+{
+    mcs_lock_t *lock;
+    uint64_t flags;
+} mcs_guard_t;
+
+static inline spinlock_guard_t spinlock_guard_acquire(spinlock_t *lock)
+{
+    return (spinlock_guard_t){lock, spinlock_acquire_irqsave(lock)};
+}
+
+static inline void spinlock_guard_release(spinlock_guard_t *guard)
+{
+    spinlock_release_irqrestore(guard->lock, guard->flags);
+}
+
+static inline mcs_guard_t mcs_guard_acquire(mcs_lock_t *lock)
+{
+    return (mcs_guard_t){lock, mcs_lock_acquire_irqsave(lock)};
+}
+
+static inline void mcs_guard_release(mcs_guard_t *guard)
+{
+    mcs_lock_release_irqrestore(guard->lock, guard->flags);
+}
+
+#define LOCK_CONCAT_(a, b) a##b
+#define LOCK_CONCAT(a, b) LOCK_CONCAT_(a, b)
+
+#define SPINLOCK_GUARD(lock)                                                                 \
+    spinlock_guard_t LOCK_CONCAT(lock_guard_, __LINE__) __attribute__((cleanup(spinlock_guard_release), unused)) = \
+        spinlock_guard_acquire(lock)
+
+#define MCS_LOCK_GUARD(lock)                                                            \
+    mcs_guard_t LOCK_CONCAT(lock_guard_, __LINE__) __attribute__((cleanup(mcs_guard_release), unused)) = \
+        mcs_guard_acquire(lock)
+
+#endif // SPINLOCK_H
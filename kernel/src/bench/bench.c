@@ -0,0 +1,11 @@
+#define LOG_MODULE "bench"
+#include <bench/bench.h>
+#include <util/log.h>
+
+void bench_run_all(void)
+{
+    info("Running microbenchmarks");
+    bench_vma();
+    bench_kmalloc();
+    bench_lock();
+}
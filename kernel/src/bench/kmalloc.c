@@ -0,0 +1,54 @@
+#define LOG_MODULE "bench"
+#include <bench/bench.h>
+#include <mm/kmalloc.h>
+#include <mm/pmm.h>
+#include <sys/cpu.h>
+#include <util/log.h>
+#include <util/memory.h>
+
+#define BENCH_KMALLOC_ITERATIONS 100000
+#define BENCH_KMALLOC_LIVE 4096
+
+/*
+ * Hot path: one kmalloc/kfree pair per size, over and over, which never leaves the per-CPU
+ * arrays. Churn: a window of live objects of mixed sizes, replaced in pseudo-random order.
+ */
+void bench_kmalloc(void)
+{
+    static const size_t sizes[] = {16, 64, 256, 1024, 4096};
+    for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        uint64_t t0 = rdtsc();
+        for (uint32_t i = 0; i < BENCH_KMALLOC_ITERATIONS; i++)
+            kfree(kmalloc(sizes[s]));
+        uint64_t t1 = rdtsc();
+        info("kmalloc: %llu byte alloc+free pair, %llu cycles", sizes[s], (t1 - t0) / BENCH_KMALLOC_ITERATIONS);
+    }
+
+    uint64_t array_pages = DIV_ROUND_UP(BENCH_KMALLOC_LIVE * sizeof(void *), PAGE_SIZE);
+    void **live = pmm_request_pages(array_pages, true);
+    if (live == NULL)
+    {
+        err("kmalloc: setup failed");
+        return;
+    }
+
+    uint64_t seed = 1;
+    for (uint32_t i = 0; i < BENCH_KMALLOC_LIVE; i++)
+        live[i] = kmalloc(8 + i % 2000);
+
+    uint64_t t0 = rdtsc();
+    for (uint32_t i = 0; i < BENCH_KMALLOC_ITERATIONS; i++)
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint32_t slot = (seed >> 33) % BENCH_KMALLOC_LIVE;
+        kfree(live[slot]);
+        live[slot] = kmalloc(8 + (seed >> 20) % 2000);
+    }
+    uint64_t t1 = rdtsc();
+    info("kmalloc: churn over %u live objects, %llu cycles per replace", BENCH_KMALLOC_LIVE, (t1 - t0) / BENCH_KMALLOC_ITERATIONS);
+
+    for (uint32_t i = 0; i < BENCH_KMALLOC_LIVE; i++)
+        kfree(live[i]);
+    pmm_release_pages(live, array_pages);
+}
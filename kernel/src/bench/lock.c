@@ -0,0 +1,204 @@
+#define LOG_MODULE "bench"
+#include <bench/bench.h>
+#include <sys/cpu.h>
+#include <sys/rwlock.h>
+#include <sys/seqlock.h>
+#include <sys/smp.h>
+#include <sys/spinlock.h>
+#include <util/log.h>
+
+#define BENCH_LOCK_ITERATIONS 100000
+#define BENCH_LOCK_WRITE_EVERY 16 // read-mostly runs: one write per this many iterations
+
+enum
+{
+    BENCH_LOCK_TAS, // the old test-and-set spinlock_t, kept here as the baseline
+    BENCH_LOCK_TICKET,
+    BENCH_LOCK_MCS,
+    BENCH_LOCK_READ_TICKET, // from here on the workload is read-mostly
+    BENCH_LOCK_RWLOCK,
+    BENCH_LOCK_SEQLOCK,
+    BENCH_LOCK_KINDS
+};
+
+static const char *lock_names[BENCH_LOCK_KINDS] = {"test-and-set", "ticket", "mcs", "read-mostly ticket", "read-mostly rwlock",
+                                                   "read-mostly seqlock"};
+
+typedef struct
+{
+    uint32_t kind;
+    volatile uint32_t tas;
+    spinlock_t ticket;
+    mcs_lock_t mcs;
+    rwlock_t rw;
+    seqlock_t seq;
+    uint64_t counter; // bumped under the lock, checked afterwards
+    uint64_t shadow;  // read-mostly runs write both, readers check they agree
+    uint64_t torn;
+
+    uint32_t ready;
+    uint32_t go;
+    uint32_t done;
+    uint64_t worst[CPU_MAX]; // longest single acquire per CPU, shows starvation
+} bench_lock_t;
+
+static bench_lock_t bench;
+
+static inline void lock_acquire(bench_lock_t *b)
+{
+    switch (b->kind)
+    {
+    case BENCH_LOCK_TAS:
+        while (__atomic_test_and_set(&b->tas, __ATOMIC_ACQUIRE))
+            __asm__ volatile("pause" ::: "memory");
+        break;
+    case BENCH_LOCK_TICKET:
+    case BENCH_LOCK_READ_TICKET:
+        spinlock_acquire(&b->ticket);
+        break;
+    case BENCH_LOCK_RWLOCK:
+        rwlock_write_acquire(&b->rw);
+        break;
+    case BENCH_LOCK_SEQLOCK:
+        seqlock_write_acquire(&b->seq);
+        break;
+    default:
+        mcs_lock_acquire(&b->mcs);
+        break;
+    }
+}
+
+static inline void lock_release(bench_lock_t *b)
+{
+    switch (b->kind)
+    {
+    case BENCH_LOCK_TAS:
+        __atomic_clear(&b->tas, __ATOMIC_RELEASE);
+        break;
+    case BENCH_LOCK_TICKET:
+    case BENCH_LOCK_READ_TICKET:
+        spinlock_release(&b->ticket);
+        break;
+    case BENCH_LOCK_RWLOCK:
+        rwlock_write_release(&b->rw);
+        break;
+    case BENCH_LOCK_SEQLOCK:
+        seqlock_write_release(&b->seq);
+        break;
+    default:
+        mcs_lock_release(&b->mcs);
+        break;
+    }
+}
+
+/* Read side of the read-mostly runs, the plain ticket lock has none and just takes the lock */
+static inline void lock_read(bench_lock_t *b)
+{
+    uint64_t counter, shadow;
+    switch (b->kind)
+    {
+    case BENCH_LOCK_RWLOCK:
+        rwlock_read_acquire(&b->rw);
+        counter = b->counter;
+        shadow = b->shadow;
+        rwlock_read_release(&b->rw);
+        break;
+    case BENCH_LOCK_SEQLOCK:
+    {
+        uint32_t seq;
+        do
+        {
+            seq = seqlock_read_begin(&b->seq);
+            counter = __atomic_load_n(&b->counter, __ATOMIC_RELAXED);
+            shadow = __atomic_load_n(&b->shadow, __ATOMIC_RELAXED);
+        } while (seqlock_read_retry(&b->seq, seq));
+        break;
+    }
+    default:
+        spinlock_acquire(&b->ticket);
+        counter = b->counter;
+        shadow = b->shadow;
+        spinlock_release(&b->ticket);
+        break;
+    }
+
+    if (counter != shadow)
+        __atomic_add_fetch(&b->torn, 1, __ATOMIC_RELAXED);
+}
+
+static void lock_worker(void *arg)
+{
+    bench_lock_t *b = arg;
+    __atomic_add_fetch(&b->ready, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&b->go, __ATOMIC_ACQUIRE))
+        __asm__ volatile("pause");
+
+    uint64_t worst = 0;
+    bool read_mostly = b->kind >= BENCH_LOCK_READ_TICKET;
+    for (uint32_t i = 0; i < BENCH_LOCK_ITERATIONS; i++)
+    {
+        uint64_t t0 = rdtsc();
+        if (read_mostly && i % BENCH_LOCK_WRITE_EVERY != 0)
+        {
+            lock_read(b);
+            uint64_t t1 = rdtsc();
+            if (t1 - t0 > worst)
+                worst = t1 - t0;
+            continue;
+        }
+
+        lock_acquire(b);
+        uint64_t t1 = rdtsc();
+        __atomic_store_n(&b->counter, b->counter + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->shadow, b->shadow + 1, __ATOMIC_RELAXED);
+        lock_release(b);
+        if (t1 - t0 > worst)
+            worst = t1 - t0;
+    }
+
+    b->worst[cpu_current_id()] = worst;
+    __atomic_add_fetch(&b->done, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Every online core hammers one lock around a shared counter. Reports wall-clock cycles per
+ * acquire/release across all cores and the worst single wait any core saw. The read-mostly runs
+ * mix in readers, which is where the rwlock and seqlock should leave the ticket lock behind.
+ */
+void bench_lock(void)
+{
+    for (uint32_t kind = 0; kind < BENCH_LOCK_KINDS; kind++)
+    {
+        bench = (bench_lock_t){.kind = kind};
+        rwlock_init(&bench.rw);
+        seqlock_init(&bench.seq);
+
+        uint32_t cpus = 1;
+        for (uint32_t i = 1; i < CPU_MAX; i++)
+            if (smp_call(i, lock_worker, &bench))
+                cpus++;
+        while (__atomic_load_n(&bench.ready, __ATOMIC_ACQUIRE) < cpus - 1)
+            __asm__ volatile("pause");
+
+        uint64_t t0 = rdtsc();
+        __atomic_store_n(&bench.go, 1, __ATOMIC_RELEASE);
+        lock_worker(&bench);
+        while (__atomic_load_n(&bench.done, __ATOMIC_ACQUIRE) < cpus)
+            __asm__ volatile("pause");
+        uint64_t t1 = rdtsc();
+
+        uint64_t ops = (uint64_t)cpus * BENCH_LOCK_ITERATIONS;
+        uint64_t writes = kind >= BENCH_LOCK_READ_TICKET ? (uint64_t)cpus * ((BENCH_LOCK_ITERATIONS + BENCH_LOCK_WRITE_EVERY - 1) / BENCH_LOCK_WRITE_EVERY) : ops;
+        uint64_t worst = 0;
+        for (uint32_t i = 0; i < CPU_MAX; i++)
+            if (bench.worst[i] > worst)
+                worst = bench.worst[i];
+
+        if (bench.counter != writes)
+            err("lock: %s lost updates, counter %llu, expected %llu", lock_names[kind], bench.counter, writes);
+        if (bench.torn)
+            err("lock: %s readers saw %llu torn updates", lock_names[kind], bench.torn);
+        info("lock: %s on %u CPU(s), %llu cycles per acquire+release, worst wait %llu cycles", lock_names[kind], cpus,
+             (t1 - t0) / ops, worst);
+    }
+}
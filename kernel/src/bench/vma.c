@@ -0,0 +1,52 @@
+#define LOG_MODULE "bench"
+#include <bench/bench.h>
+#include <mm/vma.h>
+#include <mm/vmm.h>
+#include <mm/pmm.h>
+#include <sys/cpu.h>
+#include <util/log.h>
+#include <util/memory.h>
+
+#define BENCH_VMA_REGIONS 100000
+
+/*
+ * 100k single-page regions in a fresh address space: allocate them all, free every other one,
+ * fill the holes again (so every allocation needs the gap search), then free everything.
+ */
+void bench_vma(void)
+{
+    uint64_t *pagemap = vmm_new_pagemap();
+    vma_context_t *ctx = pagemap ? vma_create_context(pagemap) : NULL;
+    uint64_t array_pages = DIV_ROUND_UP(BENCH_VMA_REGIONS * sizeof(void *), PAGE_SIZE);
+    void **regions = pmm_request_pages(array_pages, true);
+    if (ctx == NULL || regions == NULL)
+    {
+        err("vma: setup failed");
+        return;
+    }
+
+    uint64_t t0 = rdtsc();
+    for (uint64_t i = 0; i < BENCH_VMA_REGIONS; i++)
+        regions[i] = vma_alloc(ctx, 1, VMM_PRESENT | VMM_WRITE);
+
+    uint64_t t1 = rdtsc();
+    for (uint64_t i = 0; i < BENCH_VMA_REGIONS; i += 2)
+        vma_free(ctx, regions[i]);
+
+    uint64_t t2 = rdtsc();
+    for (uint64_t i = 0; i < BENCH_VMA_REGIONS; i += 2)
+        regions[i] = vma_alloc(ctx, 1, VMM_PRESENT | VMM_WRITE);
+
+    uint64_t t3 = rdtsc();
+    for (uint64_t i = 0; i < BENCH_VMA_REGIONS; i++)
+        vma_free(ctx, regions[i]);
+    uint64_t t4 = rdtsc();
+
+    info("vma: %u regions, cycles/op: alloc %llu, free %llu, refill holes %llu, free all %llu",
+         BENCH_VMA_REGIONS, (t1 - t0) / BENCH_VMA_REGIONS, (t2 - t1) / (BENCH_VMA_REGIONS / 2),
+         (t3 - t2) / (BENCH_VMA_REGIONS / 2), (t4 - t3) / BENCH_VMA_REGIONS);
+
+    vma_destroy_context(ctx);
+    vmm_destroy_pagemap(pagemap);
+    pmm_release_pages(regions, array_pages);
+}
@@ -20,6 +20,15 @@ __attribute__((used, section(".limine_requests"))) volatile struct limine_execut
     .id = LIMINE_EXECUTABLE_ADDRESS_REQUEST,
     .response = 0};
 
+__attribute__((used, section(".limine_requests"))) volatile struct limine_rsdp_request rsdp_request = {
+    .id = LIMINE_RSDP_REQUEST,
+    .revision = 0};
+
+__attribute__((used, section(".limine_requests"))) volatile struct limine_mp_request mp_request = {
+    .id = LIMINE_MP_REQUEST,
+    .revision = 0,
+    .flags = 0};
+
 /* --------------------------------------------------------------- */
 
 __attribute__((used, section(".limine_requests_start"))) volatile LIMINE_REQUESTS_START_MARKER;
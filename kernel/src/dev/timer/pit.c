@@ -2,11 +2,13 @@
 #include <dev/portio.h>
 #include <sys/pic.h>
 #include <sys/idt.h>
+#include <sys/rcu.h>
 
 void (*pit_callback)(struct register_ctx *ctx) = NULL;
 
 void pit_handler(struct register_ctx *frame)
 {
+    rcu_tick();
     if (pit_callback)
         pit_callback(frame);
     pic_eoi(0);
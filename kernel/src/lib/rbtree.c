@@ -0,0 +1,298 @@
+#include <lib/rbtree.h>
+
+static inline void augment_node(rb_node_t *node, rb_augment_fn augment)
+{
+    if (augment)
+        augment(node);
+}
+
+static void replace_child(rb_root_t *root, rb_node_t *parent, rb_node_t *old, rb_node_t *new)
+{
+    if (parent == NULL)
+        root->node = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+/* Rotations only change the subtrees of the two nodes involved, so only those get recomputed */
+static void rotate_left(rb_root_t *root, rb_node_t *node, rb_augment_fn augment)
+{
+    rb_node_t *right = node->right;
+    node->right = right->left;
+    if (right->left)
+        right->left->parent = node;
+
+    right->parent = node->parent;
+    replace_child(root, node->parent, node, right);
+    right->left = node;
+    node->parent = right;
+
+    augment_node(node, augment);
+    augment_node(right, augment);
+}
+
+static void rotate_right(rb_root_t *root, rb_node_t *node, rb_augment_fn augment)
+{
+    rb_node_t *left = node->left;
+    node->left = left->right;
+    if (left->right)
+        left->right->parent = node;
+
+    left->parent = node->parent;
+    replace_child(root, node->parent, node, left);
+    left->right = node;
+    node->parent = left;
+
+    augment_node(node, augment);
+    augment_node(left, augment);
+}
+
+/* Recomputes augmented data from `node` up to the root */
+void rb_propagate(rb_node_t *node, rb_augment_fn augment)
+{
+    if (!augment)
+        return;
+
+    for (; node; node = node->parent)
+        augment(node);
+}
+
+void rb_insert(rb_root_t *root, rb_node_t *node, rb_augment_fn augment)
+{
+    rb_propagate(node, augment);
+
+    while (node->parent && node->parent->red)
+    {
+        rb_node_t *parent = node->parent;
+        rb_node_t *grandparent = parent->parent;
+
+        if (parent == grandparent->left)
+        {
+            rb_node_t *uncle = grandparent->right;
+            if (uncle && uncle->red)
+            {
+                parent->red = uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+                continue;
+            }
+
+            if (node == parent->right)
+            {
+                rotate_left(root, parent, augment);
+                node = parent;
+                parent = node->parent;
+            }
+
+            parent->red = false;
+            grandparent->red = true;
+            rotate_right(root, grandparent, augment);
+        }
+        else
+        {
+            rb_node_t *uncle = grandparent->left;
+            if (uncle && uncle->red)
+            {
+                parent->red = uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+                continue;
+            }
+
+            if (node == parent->left)
+            {
+                rotate_right(root, parent, augment);
+                node = parent;
+                parent = node->parent;
+            }
+
+            parent->red = false;
+            grandparent->red = true;
+            rotate_left(root, grandparent, augment);
+        }
+    }
+
+    root->node->red = false;
+}
+
+static void erase_fixup(rb_root_t *root, rb_node_t *node, rb_node_t *parent, rb_augment_fn augment)
+{
+    while (node != root->node && (node == NULL || !node->red))
+    {
+        if (node == parent->left)
+        {
+            rb_node_t *sibling = parent->right;
+            if (sibling->red)
+            {
+                sibling->red = false;
+                parent->red = true;
+                rotate_left(root, parent, augment);
+                sibling = parent->right;
+            }
+
+            if ((!sibling->left || !sibling->left->red) && (!sibling->right || !sibling->right->red))
+            {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if (!sibling->right || !sibling->right->red)
+            {
+                sibling->left->red = false;
+                sibling->red = true;
+                rotate_right(root, sibling, augment);
+                sibling = parent->right;
+            }
+
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            rotate_left(root, parent, augment);
+            node = root->node;
+            break;
+        }
+        else
+        {
+            rb_node_t *sibling = parent->left;
+            if (sibling->red)
+            {
+                sibling->red = false;
+                parent->red = true;
+                rotate_right(root, parent, augment);
+                sibling = parent->left;
+            }
+
+            if ((!sibling->left || !sibling->left->red) && (!sibling->right || !sibling->right->red))
+            {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if (!sibling->left || !sibling->left->red)
+            {
+                sibling->right->red = false;
+                sibling->red = true;
+                rotate_left(root, sibling, augment);
+                sibling = parent->left;
+            }
+
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            rotate_right(root, parent, augment);
+            node = root->node;
+            break;
+        }
+    }
+
+    if (node)
+        node->red = false;
+}
+
+void rb_erase(rb_root_t *root, rb_node_t *node, rb_augment_fn augment)
+{
+    rb_node_t *child;
+    rb_node_t *parent;
+    bool removed_red;
+
+    if (node->left && node->right)
+    {
+        /* Two children: the in-order successor takes the node's place */
+        rb_node_t *successor = node->right;
+        while (successor->left)
+            successor = successor->left;
+
+        child = successor->right;
+        removed_red = successor->red;
+
+        if (successor->parent == node)
+            parent = successor;
+        else
+        {
+            parent = successor->parent;
+            parent->left = child;
+            if (child)
+                child->parent = parent;
+            successor->right = node->right;
+            node->right->parent = successor;
+        }
+
+        successor->left = node->left;
+        node->left->parent = successor;
+        successor->parent = node->parent;
+        successor->red = node->red;
+        replace_child(root, node->parent, node, successor);
+    }
+    else
+    {
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        removed_red = node->red;
+
+        if (child)
+            child->parent = parent;
+        replace_child(root, parent, node, child);
+    }
+
+    /* Everything from the lowest changed node up has lost a descendant */
+    rb_propagate(parent, augment);
+
+    if (!removed_red)
+        erase_fixup(root, child, parent, augment);
+}
+
+rb_node_t *rb_first(rb_root_t *root)
+{
+    rb_node_t *node = root->node;
+    if (!node)
+        return NULL;
+    while (node->left)
+        node = node->left;
+    return node;
+}
+
+rb_node_t *rb_last(rb_root_t *root)
+{
+    rb_node_t *node = root->node;
+    if (!node)
+        return NULL;
+    while (node->right)
+        node = node->right;
+    return node;
+}
+
+rb_node_t *rb_next(rb_node_t *node)
+{
+    if (node->right)
+    {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return node;
+    }
+
+    while (node->parent && node == node->parent->right)
+        node = node->parent;
+    return node->parent;
+}
+
+rb_node_t *rb_prev(rb_node_t *node)
+{
+    if (node->left)
+    {
+        node = node->left;
+        while (node->right)
+            node = node->right;
+        return node;
+    }
+
+    while (node->parent && node == node->parent->left)
+        node = node->parent;
+    return node->parent;
+}
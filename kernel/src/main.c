@@ -14,6 +14,16 @@
 #include <sys/pic.h>
 #include <dev/timer/pit.h>
 #include <mm/kmalloc.h>
+#include <mm/arena.h>
+#include <sys/acpi.h>
+#include <sys/numa.h>
+#include <sys/lapic.h>
+#include <sys/smp.h>
+#include <sys/rcu.h>
+#include <mm/tlb.h>
+#ifdef GENOA_BENCH
+#include <bench/bench.h>
+#endif
 
 /* Public */
 struct flanterm_context *ft_ctx = NULL;
@@ -73,8 +83,10 @@ void genoa_entry(void)
     trace("HHDM Offset: 0x%.16llx", hhdm_offset);
     trace("Kernel Stack: 0x%.16llx", kernel_stack_top);
 
+    /* Per-CPU area first, cpu_current_id() reads it through GS */
+    smp_bsp_init(kernel_stack_top);
+
     /* Interrupts */
-    gdt_init();
     idt_init();
     load_idt();
 
@@ -98,12 +110,26 @@ void genoa_entry(void)
     __kernel_virt_base = kernel_address_request.response->virtual_base;
     vmm_init();
 
+    /* Firmware tables, now that the HHDM covers them */
+    acpi_init();
+    numa_init();
+    pmm_numa_init();
+
+    /* Cross-CPU TLB invalidation needs the local APIC for IPIs */
+    lapic_init();
+    tlb_init();
+
+    vma_init();
     kernel_vma_context = vma_create_context(kernel_pagemap);
     if (kernel_vma_context == NULL)
     {
         err("Failed to create kernel VMA context");
         hcf();
     }
+    kmalloc_init();
+
+    /* Wake up the other cores */
+    smp_init();
 
     char *b = vma_alloc(kernel_vma_context, 1, VMM_PRESENT | VMM_WRITE);
     if (b == NULL)
@@ -115,6 +141,18 @@ void genoa_entry(void)
     trace("Allocated virtual page @ 0x%.16llx", (uint64_t)b);
     vma_free(kernel_vma_context, b);
 
+    /* Lazy reservation, only the touched page gets backed by the fault handler */
+    uint64_t free_before = pmm_get_free_pages();
+    char *lazy = vma_alloc(kernel_vma_context, 1024, VMM_PRESENT | VMM_WRITE | VMA_LAZY);
+    if (lazy == NULL)
+    {
+        err("Failed to reserve lazy virtual range");
+        hcf();
+    }
+    lazy[512 * PAGE_SIZE] = 32;
+    trace("Touched lazy range @ 0x%.16llx, %llu pages used", (uint64_t)lazy, free_before - pmm_get_free_pages());
+    vma_free(kernel_vma_context, lazy);
+
     /* Heap stuff */
     char *c = kmalloc(1);
     if (c == NULL)
@@ -126,8 +164,47 @@ void genoa_entry(void)
     trace("Allocated single byte using heap @ 0x%.16llx", (uint64_t)c);
     kfree(c);
 
+    /* Arena stuff */
+    arena_t arena;
+    arena_init(&arena, 0);
+    arena_mark_t mark = arena_save(&arena);
+    uint64_t *scratch = arena_alloc(&arena, 64 * sizeof(uint64_t));
+    if (scratch == NULL)
+    {
+        err("Failed to allocate from arena");
+        hcf();
+    }
+    scratch[63] = 32;
+    arena_restore(&arena, mark);
+    trace("Arena scratch @ 0x%.16llx, rewound to 0x%.16llx", (uint64_t)scratch, (uint64_t)arena_alloc(&arena, 1));
+    arena_destroy(&arena);
+
+#ifdef GENOA_BENCH
+    bench_run_all();
+#endif
+#ifdef GENOA_KMALLOC_PROFILE
+    kmalloc_profile_dump();
+#endif
+
     /* Start the timer */
     pit_init(tick);
 
-    hlt();
+    /* Idle loop, spare time goes into RCU callbacks and pre-zeroing pages */
+    for (;;)
+    {
+        rcu_process_callbacks();
+        pmm_zero_worker();
+        kmalloc_trim();
+        __asm__ volatile("cli");
+        if (rcu_callbacks_ready())
+        {
+            __asm__ volatile("sti");
+            continue;
+        }
+
+        /* sti only takes effect after the next instruction, so a tick can't slip in before hlt */
+        rcu_idle_enter();
+        __asm__ volatile("sti\n\thlt" ::: "memory");
+        rcu_idle_exit();
+    }
 }
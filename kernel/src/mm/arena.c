@@ -0,0 +1,65 @@
+#define LOG_MODULE "arena"
+#include <mm/arena.h>
+#include <mm/vma.h>
+#include <boot/boot.h>
+#include <util/log.h>
+#include <util/memory.h>
+
+void arena_init(arena_t *arena, size_t chunk_size)
+{
+    arena->first = NULL;
+    arena->chunk = NULL;
+    arena->ptr = 0;
+    arena->end = 0;
+    arena->chunk_size = chunk_size ? ALIGN_UP(chunk_size, PAGE_SIZE) : ARENA_DEFAULT_CHUNK;
+}
+
+/*
+ * Slow path, the current chunk is full. Moves on to the next chunk if an earlier round left one
+ * big enough, otherwise reserves a new one and links it in right after the current one.
+ */
+void *arena_grow(arena_t *arena, size_t size, size_t align)
+{
+    if (align < ARENA_ALIGN)
+        align = ARENA_ALIGN;
+    if (size > SIZE_MAX - sizeof(arena_chunk_t) - align)
+        return NULL;
+
+    size_t need = sizeof(arena_chunk_t) + align + size;
+    arena_chunk_t *next = arena->chunk ? arena->chunk->next : arena->first;
+    if (next == NULL || next->size < need)
+    {
+        size_t bytes = ALIGN_UP(need > arena->chunk_size ? need : arena->chunk_size, PAGE_SIZE);
+        arena_chunk_t *chunk = vma_alloc(kernel_vma_context, bytes / PAGE_SIZE, VMM_PRESENT | VMM_WRITE | VMA_LAZY);
+        if (chunk == NULL)
+        {
+            err("Failed to grow arena by %llu bytes", (uint64_t)bytes);
+            return NULL;
+        }
+
+        chunk->size = bytes;
+        chunk->next = next;
+        if (arena->chunk)
+            arena->chunk->next = chunk;
+        else
+            arena->first = chunk;
+        next = chunk;
+    }
+
+    arena->chunk = next;
+    arena->ptr = (uintptr_t)next + sizeof(arena_chunk_t);
+    arena->end = (uintptr_t)next + next->size;
+    return arena_alloc_aligned(arena, size, align);
+}
+
+void arena_destroy(arena_t *arena)
+{
+    arena_chunk_t *chunk = arena->first;
+    while (chunk)
+    {
+        arena_chunk_t *next = chunk->next;
+        vma_free(kernel_vma_context, chunk);
+        chunk = next;
+    }
+    arena_init(arena, arena->chunk_size);
+}
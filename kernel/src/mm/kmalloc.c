@@ -0,0 +1,384 @@
+#define LOG_MODULE "heap"
+#include <mm/kmalloc.h>
+#include <mm/slab.h>
+#include <mm/pmm.h>
+#include <mm/vma.h>
+#include <lib/string.h>
+#include <sys/cpu.h>
+#include <sys/spinlock.h>
+#include <util/log.h>
+#include <util/memory.h>
+
+#define KMALLOC_ALIGN 16
+#define KMALLOC_CLASSES 16
+
+extern vma_context_t *kernel_vma_context;
+
+/* Every public entry point reports to the profiler with its caller as the site */
+#ifdef GENOA_KMALLOC_PROFILE
+#define TRACK_ALLOC(ptr, size) kmalloc_profile_alloc(ptr, size, __builtin_return_address(0))
+#define TRACK_FREE(ptr) kmalloc_profile_free(ptr)
+#else
+#define TRACK_ALLOC(ptr, size) (void)0
+#define TRACK_FREE(ptr) (void)0
+#endif
+
+/* Powers of two with a step halfway between each, so no class wastes more than a third */
+static const size_t class_sizes[KMALLOC_CLASSES] = {16, 32, 48, 64, 96, 128, 192, 256,
+                                                    384, 512, 768, 1024, 1536, 2048, 3072, 4096};
+static const char *class_names[KMALLOC_CLASSES] = {"kmalloc-16", "kmalloc-32", "kmalloc-48", "kmalloc-64",
+                                                   "kmalloc-96", "kmalloc-128", "kmalloc-192", "kmalloc-256",
+                                                   "kmalloc-384", "kmalloc-512", "kmalloc-768", "kmalloc-1024",
+                                                   "kmalloc-1536", "kmalloc-2048", "kmalloc-3072", "kmalloc-4096"};
+
+static slab_cache_t *classes[KMALLOC_CLASSES];
+static uint8_t class_of[KMALLOC_MAX_SMALL / KMALLOC_ALIGN + 1]; // by size in 16 byte steps, rounded up
+
+/* The cache a small allocation came from, or NULL if ptr isn't a slab object */
+static slab_cache_t *cache_of(void *ptr)
+{
+    if ((uint64_t)ptr < hhdm_offset)
+        return NULL;
+
+    page_t *page = pmm_phys_to_page((uint64_t)PHYSICAL(ptr));
+    return page && (page->flags & PG_SLAB) ? page->slab_cache : NULL;
+}
+
+/*
+ * Spans: anything bigger than a size class gets whole pages from the current source. Freed spans
+ * are cached by length, and small ones are fetched in batches when the source can split them,
+ * so a steady stream of large allocations rarely reaches the source at all.
+ */
+static mcs_lock_t span_lock = {0};
+static void *span_cache[KMALLOC_CACHE_BINS + 1]; // idle spans by length, linked through their first word
+static uint64_t cached_pages;
+static uint64_t spans_out;
+static uint64_t span_activity; // bumped by every span alloc/free, kmalloc_trim watches it
+static uint64_t trim_seen;
+static uint64_t trim_idle;
+
+static void *pmm_source_alloc(size_t pages)
+{
+    return pmm_request_pages(pages, true);
+}
+
+static void pmm_source_free(void *ptr, size_t pages)
+{
+    pmm_release_pages(ptr, pages);
+}
+
+static void *vma_source_alloc(size_t pages)
+{
+    return vma_alloc(kernel_vma_context, pages, VMM_PRESENT | VMM_WRITE);
+}
+
+static void vma_source_free(void *ptr, size_t pages)
+{
+    (void)pages;
+    vma_free(kernel_vma_context, ptr);
+}
+
+const kmalloc_source_t kmalloc_pmm_source = {"pmm", pmm_source_alloc, pmm_source_free, true};
+const kmalloc_source_t kmalloc_vma_source = {"vma", vma_source_alloc, vma_source_free, false};
+
+static const kmalloc_source_t *source = &kmalloc_pmm_source;
+
+/* Descriptor of a span's first page, spans from either source are backed by the time we see them */
+static page_t *span_desc(void *ptr)
+{
+    uint64_t phys = (uint64_t)ptr >= hhdm_offset ? (uint64_t)PHYSICAL(ptr) : virt_to_phys(kernel_vma_context->pagemap, (uint64_t)ptr);
+    return phys ? pmm_phys_to_page(phys) : NULL;
+}
+
+static page_t *span_of(void *ptr)
+{
+    page_t *page = span_desc(ptr);
+    return page && (page->flags & PG_HEAP) ? page : NULL;
+}
+
+/*
+ * Only the cache and the counters are touched under span_lock. Source calls happen outside it:
+ * the vma source unmaps, and a TLB shootdown must never wait on a CPU spinning with interrupts off.
+ */
+static void span_cache_push(void *span, size_t pages)
+{
+    *(void **)span = span_cache[pages];
+    span_cache[pages] = span;
+    cached_pages += pages;
+}
+
+static void *span_cache_pop(size_t pages)
+{
+    void *span = pages <= KMALLOC_CACHE_BINS ? span_cache[pages] : NULL;
+    if (span)
+    {
+        span_cache[pages] = *(void **)span;
+        cached_pages -= pages;
+    }
+    return span;
+}
+
+/* Empties the cache into `bins` with span_lock held, span_cache_release frees them afterwards */
+static void span_cache_detach(void **bins)
+{
+    for (size_t pages = 1; pages <= KMALLOC_CACHE_BINS; pages++)
+    {
+        bins[pages] = span_cache[pages];
+        span_cache[pages] = NULL;
+    }
+    cached_pages = 0;
+}
+
+static void span_cache_release(const kmalloc_source_t *from, void **bins)
+{
+    for (size_t pages = 1; pages <= KMALLOC_CACHE_BINS; pages++)
+    {
+        while (bins[pages])
+        {
+            void *span = bins[pages];
+            bins[pages] = *(void **)span;
+            from->free(span, pages);
+        }
+    }
+}
+
+static void *span_alloc(size_t pages)
+{
+    /* Counted up front, so the source can't be switched while we grow from it */
+    uint64_t flags = mcs_lock_acquire_irqsave(&span_lock);
+    const kmalloc_source_t *from = source;
+    void *span = span_cache_pop(pages);
+    spans_out++;
+    span_activity++;
+    mcs_lock_release_irqrestore(&span_lock, flags);
+
+    if (span == NULL && from->split && pages < KMALLOC_GROW_PAGES)
+    {
+        size_t count = KMALLOC_GROW_PAGES / pages;
+        span = from->alloc(count * pages);
+        if (span && count > 1)
+        {
+            flags = mcs_lock_acquire_irqsave(&span_lock);
+            for (size_t i = 1; i < count; i++)
+                span_cache_push((uint8_t *)span + i * pages * PAGE_SIZE, pages);
+            mcs_lock_release_irqrestore(&span_lock, flags);
+        }
+    }
+
+    if (span == NULL)
+        span = from->alloc(pages);
+    if (span == NULL)
+    {
+        flags = mcs_lock_acquire_irqsave(&span_lock);
+        spans_out--;
+        mcs_lock_release_irqrestore(&span_lock, flags);
+        return NULL;
+    }
+
+    page_t *page = span_desc(span);
+    page->flags |= PG_HEAP;
+    page->span_pages = pages;
+    return span;
+}
+
+static void span_free(void *span, page_t *page)
+{
+    size_t pages = page->span_pages;
+    page->flags &= ~PG_HEAP;
+    page->span_pages = 0;
+
+    uint64_t flags = mcs_lock_acquire_irqsave(&span_lock);
+    const kmalloc_source_t *from = source;
+    bool cached = pages <= KMALLOC_CACHE_BINS && cached_pages + pages <= KMALLOC_CACHE_PAGES;
+    if (cached)
+        span_cache_push(span, pages);
+    spans_out--;
+    span_activity++;
+    mcs_lock_release_irqrestore(&span_lock, flags);
+
+    if (!cached)
+        from->free(span, pages);
+}
+
+void kmalloc_init(void)
+{
+    for (uint32_t i = 0; i < KMALLOC_CLASSES; i++)
+    {
+        classes[i] = slab_cache_create(class_names[i], class_sizes[i], KMALLOC_ALIGN, NULL);
+        if (classes[i] == NULL)
+        {
+            err("Failed to create %s", class_names[i]);
+            hcf();
+        }
+    }
+
+    uint32_t class = 0;
+    for (uint64_t step = 0; step <= KMALLOC_MAX_SMALL / KMALLOC_ALIGN; step++)
+    {
+        while (class_sizes[class] < step * KMALLOC_ALIGN)
+            class++;
+        class_of[step] = class;
+    }
+
+    info("Heap ready, %d size classes up to %d bytes", KMALLOC_CLASSES, KMALLOC_MAX_SMALL);
+}
+
+/* Switches the span source, only possible while no spans from the old one are handed out */
+bool kmalloc_set_source(const kmalloc_source_t *new_source)
+{
+    void *bins[KMALLOC_CACHE_BINS + 1];
+    uint64_t flags = mcs_lock_acquire_irqsave(&span_lock);
+    const kmalloc_source_t *old = source;
+    bool ok = spans_out == 0;
+    if (ok)
+    {
+        span_cache_detach(bins);
+        source = new_source;
+    }
+    mcs_lock_release_irqrestore(&span_lock, flags);
+
+    if (ok)
+    {
+        span_cache_release(old, bins);
+        info("Heap spans now come from the %s source", new_source->name);
+    }
+    else
+        warn("Can't switch heap source to %s, %llu spans still out", new_source->name, spans_out);
+    return ok;
+}
+
+/* Idle hook: hands cached spans back once large allocations have gone quiet for a while */
+void kmalloc_trim(void)
+{
+    uint64_t flags;
+    if (!mcs_lock_try_acquire_irqsave(&span_lock, &flags))
+        return;
+
+    void *bins[KMALLOC_CACHE_BINS + 1];
+    const kmalloc_source_t *from = source;
+    bool flush = false;
+    if (span_activity != trim_seen)
+    {
+        trim_seen = span_activity;
+        trim_idle = 0;
+    }
+    else if (cached_pages && ++trim_idle >= KMALLOC_TRIM_PASSES)
+    {
+        span_cache_detach(bins);
+        flush = true;
+        trim_idle = 0;
+    }
+
+    mcs_lock_release_irqrestore(&span_lock, flags);
+    if (flush)
+        span_cache_release(from, bins);
+}
+
+static void *heap_alloc(size_t size)
+{
+    if (size <= KMALLOC_MAX_SMALL)
+    {
+        if (size == 0)
+            size = 1;
+        return slab_alloc(classes[class_of[(size + KMALLOC_ALIGN - 1) / KMALLOC_ALIGN]]);
+    }
+
+    return span_alloc(DIV_ROUND_UP(size, PAGE_SIZE));
+}
+
+static void heap_free(void *ptr)
+{
+    slab_cache_t *cache = cache_of(ptr);
+    if (cache)
+    {
+        slab_free(cache, ptr);
+        return;
+    }
+
+    page_t *span = span_of(ptr);
+    if (span == NULL)
+    {
+        err("kfree on unknown pointer 0x%.16llx", (uint64_t)ptr);
+        return;
+    }
+
+    span_free(ptr, span);
+}
+
+void *kmalloc(size_t size)
+{
+    void *ptr = heap_alloc(size);
+    TRACK_ALLOC(ptr, size);
+    return ptr;
+}
+
+void kfree(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    TRACK_FREE(ptr);
+    heap_free(ptr);
+}
+
+void *krealloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        void *new = heap_alloc(size);
+        TRACK_ALLOC(new, size);
+        return new;
+    }
+    if (size == 0)
+    {
+        TRACK_FREE(ptr);
+        heap_free(ptr);
+        return NULL;
+    }
+
+    size_t old_size;
+    slab_cache_t *cache = cache_of(ptr);
+    if (cache)
+    {
+        old_size = slab_cache_size(cache);
+    }
+    else
+    {
+        page_t *span = span_of(ptr);
+        old_size = span ? span->span_pages * PAGE_SIZE : 0;
+        if (old_size == 0)
+        {
+            err("krealloc on unknown pointer 0x%.16llx", (uint64_t)ptr);
+            return NULL;
+        }
+    }
+
+    /* Still fits and wouldn't move to a smaller class, keep it where it is */
+    if (size <= old_size && (cache == NULL ? size > KMALLOC_MAX_SMALL : size > old_size / 2))
+    {
+        TRACK_FREE(ptr);
+        TRACK_ALLOC(ptr, size);
+        return ptr;
+    }
+
+    void *new = heap_alloc(size);
+    if (new == NULL)
+        return NULL;
+    memcpy(new, ptr, size < old_size ? size : old_size);
+    TRACK_FREE(ptr);
+    heap_free(ptr);
+    TRACK_ALLOC(new, size);
+    return new;
+}
+
+void *kcalloc(size_t count, size_t size)
+{
+    if (size && count > SIZE_MAX / size)
+        return NULL;
+
+    void *ptr = heap_alloc(count * size);
+    if (ptr)
+        memset(ptr, 0, count * size);
+    TRACK_ALLOC(ptr, count * size);
+    return ptr;
+}
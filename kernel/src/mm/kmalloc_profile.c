@@ -0,0 +1,224 @@
+#define LOG_MODULE "heap"
+#include <mm/kmalloc.h>
+#include <dev/portio.h>
+#include <lib/kprintf.h>
+#include <sys/cpu.h>
+#include <sys/spinlock.h>
+#include <util/log.h>
+
+#ifdef GENOA_KMALLOC_PROFILE
+
+#define PROFILE_SITES 512      // distinct call sites, power of two
+#define PROFILE_OBJECTS 16384  // live objects tracked at once, power of two
+#define PROFILE_BUCKETS 14     // size histogram: <=16, <=32, ... <=64K, bigger
+#define PROFILE_DUMP_TOP 32    // sites printed per dump
+
+typedef struct profile_site
+{
+    void *site;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t live;
+    uint64_t live_bytes;
+    uint64_t total_bytes;
+    uint32_t histogram[PROFILE_BUCKETS];
+} profile_site_t;
+
+/* Live object -> site, so kfree knows whose count to drop */
+typedef struct profile_object
+{
+    void *ptr;
+    uint32_t size;
+    uint16_t site;
+} profile_object_t;
+
+/* Both tables are open addressing with linear probing, slot 0 of a key means empty */
+static profile_site_t sites[PROFILE_SITES];
+static profile_object_t objects[PROFILE_OBJECTS];
+static uint64_t live_objects;
+static uint64_t dropped_sites;   // allocations whose site didn't fit in the table
+static uint64_t dropped_objects; // allocations not tracked because the object table was full
+static uint64_t unknown_frees;
+static spinlock_t profile_lock = {0};
+
+static inline uint64_t hash_ptr(void *ptr)
+{
+    return ((uint64_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL;
+}
+
+static inline uint32_t size_bucket(size_t size)
+{
+    uint32_t bucket = size <= 16 ? 0 : 64 - __builtin_clzll(size - 1) - 4;
+    return bucket < PROFILE_BUCKETS ? bucket : PROFILE_BUCKETS - 1;
+}
+
+static profile_site_t *site_lookup(void *site)
+{
+    for (uint64_t i = 0, slot = hash_ptr(site) & (PROFILE_SITES - 1); i < PROFILE_SITES;
+         i++, slot = (slot + 1) & (PROFILE_SITES - 1))
+    {
+        if (sites[slot].site == site)
+            return &sites[slot];
+        if (sites[slot].site == NULL)
+        {
+            sites[slot].site = site;
+            return &sites[slot];
+        }
+    }
+    return NULL;
+}
+
+static profile_object_t *object_lookup(void *ptr)
+{
+    for (uint64_t i = 0, slot = hash_ptr(ptr) & (PROFILE_OBJECTS - 1); i < PROFILE_OBJECTS;
+         i++, slot = (slot + 1) & (PROFILE_OBJECTS - 1))
+    {
+        if (objects[slot].ptr == ptr)
+            return &objects[slot];
+        if (objects[slot].ptr == NULL)
+            return NULL;
+    }
+    return NULL;
+}
+
+/* Backward-shift delete, keeps every probe chain intact without tombstones */
+static void object_remove(profile_object_t *object)
+{
+    uint64_t hole = object - objects;
+    uint64_t slot = hole;
+    for (;;)
+    {
+        slot = (slot + 1) & (PROFILE_OBJECTS - 1);
+        if (objects[slot].ptr == NULL)
+            break;
+
+        uint64_t home = hash_ptr(objects[slot].ptr) & (PROFILE_OBJECTS - 1);
+        if (((slot - home) & (PROFILE_OBJECTS - 1)) >= ((slot - hole) & (PROFILE_OBJECTS - 1)))
+        {
+            objects[hole] = objects[slot];
+            hole = slot;
+        }
+    }
+    objects[hole].ptr = NULL;
+}
+
+void kmalloc_profile_alloc(void *ptr, size_t size, void *site)
+{
+    if (ptr == NULL)
+        return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&profile_lock);
+
+    profile_site_t *entry = site_lookup(site);
+    if (entry == NULL)
+    {
+        dropped_sites++;
+    }
+    else
+    {
+        entry->allocs++;
+        entry->total_bytes += size;
+        entry->histogram[size_bucket(size)]++;
+
+        if (live_objects < PROFILE_OBJECTS - PROFILE_OBJECTS / 8)
+        {
+            uint64_t slot = hash_ptr(ptr) & (PROFILE_OBJECTS - 1);
+            while (objects[slot].ptr != NULL)
+                slot = (slot + 1) & (PROFILE_OBJECTS - 1);
+            objects[slot].ptr = ptr;
+            objects[slot].size = size > UINT32_MAX ? UINT32_MAX : size;
+            objects[slot].site = entry - sites;
+            live_objects++;
+            entry->live++;
+            entry->live_bytes += size;
+        }
+        else
+        {
+            dropped_objects++;
+        }
+    }
+
+    spinlock_release_irqrestore(&profile_lock, flags);
+}
+
+void kmalloc_profile_free(void *ptr)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&profile_lock);
+
+    profile_object_t *object = object_lookup(ptr);
+    if (object)
+    {
+        profile_site_t *entry = &sites[object->site];
+        entry->frees++;
+        entry->live--;
+        entry->live_bytes -= object->size;
+        object_remove(object);
+        live_objects--;
+    }
+    else
+    {
+        unknown_frees++;
+    }
+
+    spinlock_release_irqrestore(&profile_lock, flags);
+}
+
+/* Straight to the debug console, the dump is far too long for the framebuffer */
+static void e9_printf(const char *fmt, ...)
+{
+    char buffer[256];
+    va_list args;
+    va_start(args, fmt);
+    int length = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+
+    if (length > (int)sizeof(buffer) - 1)
+        length = sizeof(buffer) - 1;
+    for (int i = 0; i < length; i++)
+        outb(0xE9, buffer[i]);
+}
+
+/* Sites sorted by live bytes, then by allocation count, so leaks and hot sites both float up */
+void kmalloc_profile_dump(void)
+{
+    static uint16_t order[PROFILE_SITES];
+    uint32_t count = 0;
+
+    uint64_t flags = spinlock_acquire_irqsave(&profile_lock);
+
+    for (uint32_t i = 0; i < PROFILE_SITES; i++)
+    {
+        if (sites[i].site == NULL)
+            continue;
+
+        uint32_t j = count++;
+        while (j > 0 && (sites[order[j - 1]].live_bytes < sites[i].live_bytes ||
+                         (sites[order[j - 1]].live_bytes == sites[i].live_bytes && sites[order[j - 1]].allocs < sites[i].allocs)))
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    e9_printf("kmalloc profile: %u sites, %llu live objects, %llu untracked, %llu sites dropped, %llu unknown frees\n",
+              count, live_objects, dropped_objects, dropped_sites, unknown_frees);
+    e9_printf("%-18s %10s %10s %8s %12s %12s  histogram (16B, 32B, ... 64K, more)\n",
+              "site", "allocs", "frees", "live", "live bytes", "total bytes");
+
+    for (uint32_t i = 0; i < count && i < PROFILE_DUMP_TOP; i++)
+    {
+        profile_site_t *entry = &sites[order[i]];
+        e9_printf("0x%.16llx %10llu %10llu %8llu %12llu %12llu ", (uint64_t)entry->site, entry->allocs, entry->frees,
+                  entry->live, entry->live_bytes, entry->total_bytes);
+        for (uint32_t b = 0; b < PROFILE_BUCKETS; b++)
+            e9_printf(" %u", entry->histogram[b]);
+        e9_printf("\n");
+    }
+
+    spinlock_release_irqrestore(&profile_lock, flags);
+
+    info("kmalloc profile dumped to the debug console, %u sites", count);
+}
+
+#endif // GENOA_KMALLOC_PROFILE
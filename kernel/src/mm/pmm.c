@@ -7,26 +7,607 @@
 #include <lib/string.h>
 #include <lib/bitmap.h>
 #include <sys/spinlock.h>
+#include <sys/numa.h>
 
-#define PAGE_CACHE_SIZE 1024
 #define MIN_ALIGN PAGE_SIZE
+#define MAGAZINE_SIZE 64
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2)
 #define BITMAP_WORD_SIZE (sizeof(uint64_t) * 8)
+#define SUMMARY_MAX_LEVELS 4
+#define NO_PAGE UINT64_MAX
+#define PMM_MAX_ZONES (NUMA_MAX_RANGES + 2)
+#define ZERO_POOL_TARGET 256 // pre-zeroed pages the idle loop keeps around (1 MiB)
+#define ZERO_POOL_BATCH 16   // pages zeroed per idle pass, so an interrupt never waits long
+#define ZERO_POOL_RESERVE 4096 // don't fill the pool once free memory gets this low
+
+enum
+{
+    ZONE_DMA,    // below PMM_DMA_LIMIT, for legacy ISA DMA
+    ZONE_DMA32,  // below PMM_DMA32_LIMIT, for 32-bit devices
+    ZONE_NORMAL, // everything else
+    ZONE_TYPES
+};
+
+static const char *zone_names[ZONE_TYPES] = {"DMA", "DMA32", "Normal"};
+
+/* A contiguous pfn range owned by one node and one zone type, buddies never merge across zones */
+typedef struct pmm_zone
+{
+    uint32_t node;
+    uint32_t type;
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+    uint64_t free_pages;
+    page_t *free_lists[PMM_MAX_ORDER + 1]; // linked through the head page's descriptor
+    uint64_t free_blocks[PMM_MAX_ORDER + 1];
+} pmm_zone_t;
+
+/* Per-CPU stash of single pages, only ever touched by its own CPU with interrupts off */
+typedef struct pmm_magazine
+{
+    uint64_t count;
+    uint64_t pfns[MAGAZINE_SIZE];
+    pmm_cpu_stats_t stats;
+} __attribute__((aligned(64))) pmm_magazine_t;
 
 struct limine_memmap_response *memmap;
 uint64_t bitmap_pages;
 uint64_t bitmap_size;
 uint8_t *bitmap;
-static uint64_t free_pages;
-static spinlock_t pmm_lock;
-static uint64_t page_cache[PAGE_CACHE_SIZE];
-static size_t cache_size;
-static size_t cache_index;
+page_t *pmm_pages;
+static uint64_t meta_phys, meta_length; // where pmm_init put the bitmaps and pmm_pages
+static uint64_t free_pages; // pages on the buddy free lists, written under pmm_lock but read without it
+static mcs_lock_t pmm_lock;
+static pmm_zone_t zones[PMM_MAX_ZONES];
+static uint32_t zone_count;
+static pmm_magazine_t magazines[CPU_MAX];
+static page_t *zero_pool; // pre-zeroed pages, linked through their descriptors
+static uint64_t zero_count;
+static spinlock_t zero_lock;
+
+/*
+ * Summary bitmaps: bit n of level 0 is set when bitmap word n is full, bit n of
+ * level l + 1 is set when word n of level l is full. Padding bits are always set.
+ */
+static uint64_t *summary[SUMMARY_MAX_LEVELS];
+static uint64_t summary_words[SUMMARY_MAX_LEVELS];
+static uint32_t summary_levels;
 
 static inline bool is_aligned(void *addr, size_t align)
 {
     return ((uintptr_t)addr % align) == 0;
 }
 
+static inline uint64_t page_to_pfn(page_t *page)
+{
+    return (uint64_t)(page - pmm_pages);
+}
+
+static inline uint32_t order_for_pages(size_t pages)
+{
+    return pages <= 1 ? 0 : 64 - __builtin_clzll(pages - 1);
+}
+
+/* Zones are sorted and cover [0, bitmap_pages) without gaps */
+static pmm_zone_t *zone_of(uint64_t pfn)
+{
+    uint32_t low = 0, high = zone_count - 1;
+    while (low < high)
+    {
+        uint32_t mid = (low + high + 1) / 2;
+        if (zones[mid].start_pfn <= pfn)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return &zones[low];
+}
+
+/* Free list helpers, pmm_lock must be held */
+static void free_list_push(pmm_zone_t *zone, uint64_t pfn, uint32_t order)
+{
+    page_t *page = &pmm_pages[pfn];
+    page->prev = NULL;
+    page->next = zone->free_lists[order];
+    if (page->next)
+        page->next->prev = page;
+    zone->free_lists[order] = page;
+    zone->free_blocks[order]++;
+    zone->free_pages += 1ULL << order;
+    __atomic_store_n(&free_pages, free_pages + (1ULL << order), __ATOMIC_RELAXED);
+    page->order = order + 1;
+}
+
+static void free_list_remove(pmm_zone_t *zone, uint64_t pfn, uint32_t order)
+{
+    page_t *page = &pmm_pages[pfn];
+    if (page->prev)
+        page->prev->next = page->next;
+    else
+        zone->free_lists[order] = page->next;
+    if (page->next)
+        page->next->prev = page->prev;
+    zone->free_blocks[order]--;
+    zone->free_pages -= 1ULL << order;
+    __atomic_store_n(&free_pages, free_pages - (1ULL << order), __ATOMIC_RELAXED);
+    page->order = 0;
+}
+
+/* Buddy core */
+static void buddy_free(pmm_zone_t *zone, uint64_t pfn, uint32_t order)
+{
+    while (order < PMM_MAX_ORDER)
+    {
+        uint64_t buddy = pfn ^ (1ULL << order);
+        if (buddy < zone->start_pfn || buddy >= zone->end_pfn || pmm_pages[buddy].order != order + 1)
+            break;
+
+        free_list_remove(zone, buddy, order);
+        pfn &= ~(1ULL << order);
+        order++;
+    }
+    free_list_push(zone, pfn, order);
+}
+
+/* Takes a free block off its list and splits it down to `order`, keeping the lowest part */
+static void buddy_take(pmm_zone_t *zone, uint64_t pfn, uint32_t current, uint32_t order)
+{
+    free_list_remove(zone, pfn, current);
+
+    while (current > order)
+    {
+        current--;
+        free_list_push(zone, pfn + (1ULL << current), current);
+    }
+}
+
+static bool buddy_alloc(pmm_zone_t *zone, uint32_t order, uint64_t *out)
+{
+    uint32_t current = order;
+    while (current <= PMM_MAX_ORDER && zone->free_lists[current] == NULL)
+        current++;
+
+    if (current > PMM_MAX_ORDER)
+        return false;
+
+    *out = page_to_pfn(zone->free_lists[current]);
+    buddy_take(zone, *out, current, order);
+    return true;
+}
+
+/* Like buddy_alloc, but only takes blocks that end at or below limit_pfn */
+static bool buddy_alloc_below(pmm_zone_t *zone, uint32_t order, uint64_t limit_pfn, uint64_t *out)
+{
+    if (zone->end_pfn <= limit_pfn)
+        return buddy_alloc(zone, order, out);
+
+    for (uint32_t current = order; current <= PMM_MAX_ORDER; current++)
+    {
+        for (page_t *page = zone->free_lists[current]; page; page = page->next)
+        {
+            uint64_t pfn = page_to_pfn(page);
+            if (pfn + (1ULL << order) <= limit_pfn)
+            {
+                buddy_take(zone, pfn, current, order);
+                *out = pfn;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * Tries the zones of the preferred node first, then everything else. Higher
+ * zones go first so DMA-capable memory is only used once the rest runs out.
+ */
+static bool buddy_alloc_node(uint32_t node, uint32_t order, uint64_t *out)
+{
+    for (uint32_t pass = 0; pass < 2; pass++)
+    {
+        for (int type = ZONE_NORMAL; type >= ZONE_DMA; type--)
+        {
+            for (uint32_t i = 0; i < zone_count; i++)
+            {
+                if ((zones[i].node == node) == (pass == 0) && zones[i].type == (uint32_t)type &&
+                    buddy_alloc(&zones[i], order, out))
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* Splits [start, end) along the DMA limits and appends the pieces as zones */
+static void zone_add(uint32_t node, uint64_t start, uint64_t end)
+{
+    static const uint64_t limits[ZONE_TYPES] = {PMM_DMA_LIMIT / PAGE_SIZE, PMM_DMA32_LIMIT / PAGE_SIZE, UINT64_MAX};
+
+    for (uint32_t type = 0; type < ZONE_TYPES; type++)
+    {
+        uint64_t low = type ? limits[type - 1] : 0;
+        uint64_t zone_start = start > low ? start : low;
+        uint64_t zone_end = end < limits[type] ? end : limits[type];
+        if (zone_start >= zone_end || zone_count == PMM_MAX_ZONES)
+            continue;
+
+        memset(&zones[zone_count], 0, sizeof(pmm_zone_t));
+        zones[zone_count].node = node;
+        zones[zone_count].type = type;
+        zones[zone_count].start_pfn = zone_start;
+        zones[zone_count].end_pfn = zone_end;
+        zone_count++;
+
+        for (uint64_t pfn = zone_start; pfn < zone_end; pfn++)
+            pmm_pages[pfn].node = node;
+    }
+}
+
+/* Splits [start, start + count) into the largest naturally aligned blocks and frees them */
+static void buddy_free_range(uint64_t start, uint64_t count)
+{
+    uint64_t end = start + count;
+    while (start < end)
+    {
+        pmm_zone_t *zone = zone_of(start);
+        uint32_t order = start ? __builtin_ctzll(start) : PMM_MAX_ORDER;
+        if (order > PMM_MAX_ORDER)
+            order = PMM_MAX_ORDER;
+        while ((1ULL << order) > end - start || start + (1ULL << order) > zone->end_pfn)
+            order--;
+
+        buddy_free(zone, start, order);
+        start += 1ULL << order;
+    }
+}
+
+/* Summary bitmap helpers, pmm_lock must be held */
+static void summary_update(uint64_t word)
+{
+    bool full = ((uint64_t *)bitmap)[word] == UINT64_MAX;
+
+    for (uint32_t level = 0; level < summary_levels; level++)
+    {
+        uint64_t *entry = &summary[level][word / BITMAP_WORD_SIZE];
+        uint64_t old = *entry;
+        *entry = full ? old | BIT(word % BITMAP_WORD_SIZE) : old & ~BIT(word % BITMAP_WORD_SIZE);
+        if (*entry == old)
+            return;
+
+        full = *entry == UINT64_MAX;
+        word /= BITMAP_WORD_SIZE;
+    }
+}
+
+static void summary_update_range(uint64_t start, uint64_t count)
+{
+    for (uint64_t w = start / BITMAP_WORD_SIZE; w <= (start + count - 1) / BITMAP_WORD_SIZE; w++)
+        summary_update(w);
+}
+
+static void mark_used(uint64_t start, uint64_t count)
+{
+    bitmap_set_range(bitmap, start, count);
+    summary_update_range(start, count);
+}
+
+static void mark_free(uint64_t start, uint64_t count)
+{
+    bitmap_clear_range(bitmap, start, count);
+    summary_update_range(start, count);
+}
+
+/* First clear bit at or after `from` on a summary level, or NO_PAGE */
+static uint64_t summary_find_clear(uint32_t level, uint64_t from)
+{
+    uint64_t idx = from / BITMAP_WORD_SIZE;
+    if (idx >= summary_words[level])
+        return NO_PAGE;
+
+    uint64_t clear = ~summary[level][idx] & (UINT64_MAX << (from % BITMAP_WORD_SIZE));
+    if (clear)
+        return idx * BITMAP_WORD_SIZE + __builtin_ctzll(clear);
+
+    if (level + 1 < summary_levels)
+    {
+        idx = summary_find_clear(level + 1, idx + 1);
+        if (idx == NO_PAGE)
+            return NO_PAGE;
+    }
+    else
+    {
+        do
+        {
+            if (++idx >= summary_words[level])
+                return NO_PAGE;
+        } while (summary[level][idx] == UINT64_MAX);
+    }
+
+    return idx * BITMAP_WORD_SIZE + __builtin_ctzll(~summary[level][idx]);
+}
+
+static uint64_t next_free_page(uint64_t pos)
+{
+    uint64_t *words = (uint64_t *)bitmap;
+    uint64_t word = pos / BITMAP_WORD_SIZE;
+
+    uint64_t clear = ~words[word] & (UINT64_MAX << (pos % BITMAP_WORD_SIZE));
+    if (!clear)
+    {
+        word = summary_find_clear(0, word + 1);
+        if (word == NO_PAGE)
+            return NO_PAGE;
+        clear = ~words[word];
+    }
+
+    pos = word * BITMAP_WORD_SIZE + __builtin_ctzll(clear);
+    return pos < bitmap_pages ? pos : NO_PAGE;
+}
+
+/* First used page in [pos, limit), or limit */
+static uint64_t next_used_page(uint64_t pos, uint64_t limit)
+{
+    uint64_t *words = (uint64_t *)bitmap;
+
+    while (pos < limit)
+    {
+        uint64_t word = pos / BITMAP_WORD_SIZE;
+        uint64_t used = words[word] & (UINT64_MAX << (pos % BITMAP_WORD_SIZE));
+        if (used)
+        {
+            pos = word * BITMAP_WORD_SIZE + __builtin_ctzll(used);
+            return pos < limit ? pos : limit;
+        }
+        pos = (word + 1) * BITMAP_WORD_SIZE;
+    }
+
+    return limit;
+}
+
+/* Finds a run of free pages starting on an `align` page boundary and ending at or below limit_pfn */
+static bool find_free_run(uint64_t pages, uint64_t align, uint64_t limit_pfn, uint64_t *out)
+{
+    uint64_t pos = 0;
+
+    if (limit_pfn > bitmap_pages)
+        limit_pfn = bitmap_pages;
+
+    for (;;)
+    {
+        pos = next_free_page(pos);
+        if (pos == NO_PAGE)
+            return false;
+
+        pos = ALIGN_UP(pos, align);
+        if (pos + pages > limit_pfn)
+            return false;
+
+        uint64_t end = next_used_page(pos, pos + pages);
+        if (end == pos + pages)
+        {
+            *out = pos;
+            return true;
+        }
+        pos = end;
+    }
+}
+
+/* Pulls [start, start + count) out of whatever free blocks it's spread over */
+static void buddy_carve_range(uint64_t start, uint64_t count)
+{
+    uint64_t end = start + count;
+    uint64_t pfn = start;
+
+    while (pfn < end)
+    {
+        uint64_t head = pfn;
+        uint32_t order = 0;
+        while (order <= PMM_MAX_ORDER)
+        {
+            head = pfn & ~((1ULL << order) - 1);
+            if (pmm_pages[head].order == order + 1)
+                break;
+            order++;
+        }
+
+        if (order > PMM_MAX_ORDER)
+        {
+            err("Page 0x%llx is free but not in any buddy block", pfn);
+            pfn++;
+            continue;
+        }
+
+        uint64_t block_end = head + (1ULL << order);
+        free_list_remove(zone_of(head), head, order);
+        if (head < start)
+            buddy_free_range(head, start - head);
+        if (block_end > end)
+            buddy_free_range(end, block_end - end);
+        pfn = block_end;
+    }
+}
+
+static bool alloc_pages_locked(uint32_t node, size_t pages, uint64_t *out)
+{
+    uint32_t order = order_for_pages(pages);
+
+    if (order <= PMM_MAX_ORDER && buddy_alloc_node(node, order, out))
+    {
+        /* Hand the unused tail of the block straight back */
+        if ((1ULL << order) > pages)
+            buddy_free_range(*out + pages, (1ULL << order) - pages);
+    }
+    else if (find_free_run(pages, 1, bitmap_pages, out))
+    {
+        buddy_carve_range(*out, pages);
+    }
+    else
+    {
+        return false;
+    }
+
+    mark_used(*out, pages);
+    return true;
+}
+
+/* Magazine helpers, called with interrupts disabled on the owning CPU */
+static void magazine_refill(pmm_magazine_t *mag)
+{
+    uint32_t node = numa_node_of_cpu(cpu_current_id());
+
+    mcs_lock_acquire(&pmm_lock);
+    while (mag->count < MAGAZINE_BATCH)
+    {
+        uint64_t pfn;
+        if (!buddy_alloc_node(node, 0, &pfn))
+            break;
+        mark_used(pfn, 1);
+        pmm_pages[pfn].flags |= PG_MAGAZINE;
+        mag->pfns[mag->count++] = pfn;
+    }
+    mcs_lock_release(&pmm_lock);
+    mag->stats.refills++;
+}
+
+static void magazine_drain(pmm_magazine_t *mag, uint64_t keep)
+{
+    mcs_lock_acquire(&pmm_lock);
+    while (mag->count > keep)
+    {
+        uint64_t pfn = mag->pfns[--mag->count];
+        pmm_pages[pfn].flags &= ~PG_MAGAZINE;
+        mark_free(pfn, 1);
+        buddy_free(zone_of(pfn), pfn, 0);
+    }
+    mcs_lock_release(&pmm_lock);
+    mag->stats.drains++;
+}
+
+static void *magazine_alloc(void)
+{
+    uint64_t flags = int_save_disable();
+    pmm_magazine_t *mag = &magazines[cpu_current_id()];
+
+    if (mag->count)
+    {
+        mag->stats.hits++;
+    }
+    else
+    {
+        mag->stats.misses++;
+        magazine_refill(mag);
+        if (mag->count == 0)
+        {
+            int_restore(flags);
+            return NULL;
+        }
+    }
+
+    uint64_t pfn = mag->pfns[--mag->count];
+    pmm_pages[pfn].flags &= ~PG_MAGAZINE;
+    int_restore(flags);
+    return (void *)(pfn * PAGE_SIZE);
+}
+
+static void magazine_free(uint64_t pfn)
+{
+    uint64_t flags = int_save_disable();
+    pmm_magazine_t *mag = &magazines[cpu_current_id()];
+
+    /* Magazine pages still look used in the bitmap, the flag is what catches a second free */
+    if (pmm_pages[pfn].flags & PG_MAGAZINE)
+    {
+        int_restore(flags);
+        warn("Double free of page 0x%llx", pfn * PAGE_SIZE);
+        return;
+    }
+    pmm_pages[pfn].flags |= PG_MAGAZINE;
+
+    if (mag->count == MAGAZINE_SIZE)
+        magazine_drain(mag, MAGAZINE_SIZE - MAGAZINE_BATCH);
+
+    mag->pfns[mag->count++] = pfn;
+    int_restore(flags);
+}
+
+/*
+ * Zero pool. Pages in it are allocated as far as the bitmap is concerned and already cleared,
+ * pmm_zero_worker fills it with non-temporal stores so the idle loop doesn't evict anything.
+ */
+static void zero_page_nt(uint64_t pfn)
+{
+    uint64_t *p = (uint64_t *)(pfn * PAGE_SIZE + hhdm_offset);
+    for (uint64_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 4)
+    {
+        __asm__ volatile("movnti %1, 0(%0)\n\t"
+                         "movnti %1, 8(%0)\n\t"
+                         "movnti %1, 16(%0)\n\t"
+                         "movnti %1, 24(%0)"
+                         :
+                         : "r"(p + i), "r"(0ULL)
+                         : "memory");
+    }
+}
+
+/* For pages the caller is about to touch anyway, so the lines may as well end up in cache */
+static void zero_page_cached(uint64_t pfn)
+{
+    void *p = (void *)(pfn * PAGE_SIZE + hhdm_offset);
+    uint64_t count = PAGE_SIZE / sizeof(uint64_t);
+    __asm__ volatile("rep stosq" : "+D"(p), "+c"(count) : "a"(0ULL) : "memory");
+}
+
+/* Called with interrupts disabled */
+static uint64_t zero_pool_pop(void)
+{
+    spinlock_acquire(&zero_lock);
+    page_t *page = zero_pool;
+    if (page)
+    {
+        zero_pool = page->next;
+        page->next = NULL;
+        zero_count--;
+    }
+    spinlock_release(&zero_lock);
+    return page ? page_to_pfn(page) : NO_PAGE;
+}
+
+/* Hands the whole pool back to the buddy allocator, returns false if it was empty */
+static bool zero_pool_drain(void)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&zero_lock);
+    page_t *chain = zero_pool;
+    zero_pool = NULL;
+    zero_count = 0;
+    spinlock_release_irqrestore(&zero_lock, flags);
+
+    if (chain == NULL)
+        return false;
+
+    flags = mcs_lock_acquire_irqsave(&pmm_lock);
+    while (chain)
+    {
+        page_t *next = chain->next;
+        uint64_t pfn = page_to_pfn(chain);
+        chain->next = NULL;
+        mark_free(pfn, 1);
+        buddy_free(zone_of(pfn), pfn, 0);
+        chain = next;
+    }
+    mcs_lock_release_irqrestore(&pmm_lock, flags);
+    return true;
+}
+
+/* Our own magazine and the zero pool might be holding the buddies we need. Interrupts off, pmm_lock not held */
+static bool drain_caches(void)
+{
+    pmm_magazine_t *mag = &magazines[cpu_current_id()];
+    bool drained = mag->count != 0;
+    if (drained)
+        magazine_drain(mag, 0);
+    return zero_pool_drain() || drained;
+}
+
 void pmm_init(void)
 {
     if (!memmap_request.response)
@@ -35,7 +616,8 @@ void pmm_init(void)
         hcf();
     }
     memmap = memmap_request.response;
-    spinlock_init(&pmm_lock);
+    mcs_lock_init(&pmm_lock);
+    spinlock_init(&zero_lock);
 
     uint64_t high = 0;
     free_pages = 0;
@@ -48,101 +630,260 @@ void pmm_init(void)
             uint64_t top = e->base + e->length;
             if (top > high)
                 high = top;
-            free_pages += e->length / PAGE_SIZE;
             mem("Usable memory region: 0x%.16llx -> 0x%.16llx", e->base, e->base + e->length);
         }
     }
 
     bitmap_pages = high / PAGE_SIZE;
-    bitmap_size = ALIGN_UP(bitmap_pages / 8, PAGE_SIZE);
+    bitmap_size = ALIGN_UP(DIV_ROUND_UP(bitmap_pages, 8), sizeof(uint64_t));
+
+    summary_levels = 0;
+    uint64_t summary_size = 0;
+    uint64_t level_bits = bitmap_size / sizeof(uint64_t);
+    do
+    {
+        summary_words[summary_levels] = DIV_ROUND_UP(level_bits, BITMAP_WORD_SIZE);
+        summary_size += summary_words[summary_levels] * sizeof(uint64_t);
+        level_bits = summary_words[summary_levels++];
+    } while (level_bits > 1 && summary_levels < SUMMARY_MAX_LEVELS);
+
+    uint64_t order_offset = bitmap_size + summary_size;
+    uint64_t pages_offset = ALIGN_UP(order_offset, 64);
+    uint64_t meta_size = ALIGN_UP(pages_offset + bitmap_pages * sizeof(page_t), PAGE_SIZE);
 
     for (uint64_t i = 0; i < memmap->entry_count; i++)
     {
         struct limine_memmap_entry *e = memmap->entries[i];
-        if (e->type == LIMINE_MEMMAP_USABLE && e->length >= bitmap_size)
+        if (e->type == LIMINE_MEMMAP_USABLE && e->length >= meta_size)
         {
             bitmap = (uint8_t *)(e->base + hhdm_offset);
-            memset(bitmap, 0xFF, bitmap_size);
-            e->base += bitmap_size;
-            e->length -= bitmap_size;
-            free_pages -= bitmap_size / PAGE_SIZE;
+            pmm_pages = (page_t *)(bitmap + pages_offset);
+            memset(bitmap, 0xFF, order_offset);
+            memset(pmm_pages, 0, bitmap_pages * sizeof(page_t));
+
+            uint64_t *level = (uint64_t *)(bitmap + bitmap_size);
+            for (uint32_t l = 0; l < summary_levels; l++)
+            {
+                summary[l] = level;
+                level += summary_words[l];
+            }
+            meta_phys = e->base;
+            meta_length = meta_size;
+            e->base += meta_size;
+            e->length -= meta_size;
             break;
         }
     }
 
-    cache_size = PAGE_CACHE_SIZE;
-    cache_index = 0;
-    memset(page_cache, 0, sizeof(page_cache));
+    if (bitmap == NULL)
+    {
+        err("No usable region large enough for PMM metadata, halting");
+        hcf();
+    }
+
+    /* One node until pmm_numa_init knows better */
+    zone_count = 0;
+    zone_add(0, 0, bitmap_pages);
 
     for (uint64_t i = 0; i < memmap->entry_count; i++)
     {
         struct limine_memmap_entry *e = memmap->entries[i];
-        if (e->type == LIMINE_MEMMAP_USABLE)
+        if (e->type == LIMINE_MEMMAP_USABLE && e->length >= PAGE_SIZE)
+        {
+            uint64_t start = e->base / PAGE_SIZE;
+            uint64_t count = e->length / PAGE_SIZE;
+
+            for (uint64_t pfn = start; pfn < start + count; pfn++)
+                pmm_pages[pfn].flags = PG_RAM;
+            mark_free(start, count);
+            buddy_free_range(start, count);
+        }
+    }
+
+    mem("Buddy allocator ready, %llu free pages, max order %d", free_pages, PMM_MAX_ORDER);
+}
+
+void pmm_numa_init(void)
+{
+    if (numa_range_count() == 0)
+        return;
+
+    uint64_t flags = mcs_lock_acquire_irqsave(&pmm_lock);
+
+    /*
+     * Pull every free block off the old zones into one chain, with the order
+     * parked in `private`, then free them again so they get split along node lines.
+     */
+    page_t *chain = NULL;
+    for (uint32_t z = 0; z < zone_count; z++)
+    {
+        for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++)
         {
-            for (uint64_t j = e->base; j < e->base + e->length; j += PAGE_SIZE)
+            while (zones[z].free_lists[order])
             {
-                if ((j / PAGE_SIZE) < bitmap_pages)
-                {
-                    bitmap_clear(bitmap, j / PAGE_SIZE);
-                }
+                page_t *page = zones[z].free_lists[order];
+                free_list_remove(&zones[z], page_to_pfn(page), order);
+                page->next = chain;
+                page->private = order;
+                chain = page;
             }
         }
     }
+
+    /* Adjacent ranges on the same node are one span, holes belong to the span below them */
+    uint32_t span_nodes[NUMA_MAX_RANGES];
+    uint64_t span_starts[NUMA_MAX_RANGES];
+    uint32_t spans = 0;
+    for (uint32_t i = 0; i < numa_range_count(); i++)
+    {
+        const numa_memory_range_t *range = numa_get_range(i);
+        uint64_t start = range->base / PAGE_SIZE;
+        if (start >= bitmap_pages)
+            break;
+        if (spans && span_nodes[spans - 1] == range->node)
+            continue;
+
+        span_nodes[spans] = range->node;
+        span_starts[spans] = spans ? start : 0;
+        spans++;
+    }
+
+    zone_count = 0;
+    for (uint32_t i = 0; i < spans; i++)
+        zone_add(span_nodes[i], span_starts[i], i + 1 < spans ? span_starts[i + 1] : bitmap_pages);
+
+    while (chain)
+    {
+        page_t *next = chain->next;
+        uint32_t order = (uint32_t)chain->private;
+        chain->private = 0;
+        buddy_free_range(page_to_pfn(chain), 1ULL << order);
+        chain = next;
+    }
+
+    mcs_lock_release_irqrestore(&pmm_lock, flags);
+
+    pmm_dump_zones();
 }
 
 void *pmm_request_pages(size_t pages, bool higher_half)
 {
-    if (pages == 0 || pages > free_pages)
-        return NULL;
-
-    spinlock_acquire(&pmm_lock);
+    return pmm_request_pages_node(pages, higher_half, numa_node_of_cpu(cpu_current_id()));
+}
 
-    if (pages == 1 && cache_index > 0)
+void *pmm_request_pages_node(size_t pages, bool higher_half, uint32_t node)
+{
+    /* Remote frees skip the magazines, so ours only holds this node's pages unless refill had to fall back */
+    if (pages == 1 && node == numa_node_of_cpu(cpu_current_id()))
     {
-        void *addr = (void *)(page_cache[--cache_index] * PAGE_SIZE);
-        bitmap_set(bitmap, (uint64_t)addr / PAGE_SIZE);
-        free_pages--;
-        spinlock_release(&pmm_lock);
+        void *addr = magazine_alloc();
+        if (addr == NULL)
+        {
+            /* Out of everything else, a pre-zeroed page is still a page */
+            uint64_t flags = int_save_disable();
+            uint64_t pfn = zero_pool_pop();
+            int_restore(flags);
+            if (pfn == NO_PAGE)
+                return NULL;
+            addr = (void *)(pfn * PAGE_SIZE);
+        }
         return higher_half ? (void *)((uint64_t)addr + hhdm_offset) : addr;
     }
 
-    uint64_t word_count = (bitmap_pages + BITMAP_WORD_SIZE - 1) / BITMAP_WORD_SIZE;
-    uint64_t *bitmap_words = (uint64_t *)bitmap;
+    /* Not checked against free_pages, that doesn't count what's sitting in magazines */
+    if (pages == 0)
+        return NULL;
+
+    uint64_t flags = mcs_lock_acquire_irqsave(&pmm_lock);
 
-    for (uint64_t i = 0; i < word_count; i++)
+    uint64_t pfn;
+    if (!alloc_pages_locked(node, pages, &pfn))
     {
-        if (bitmap_words[i] != UINT64_MAX)
+        /* Interrupts stay off so the magazine we drain is still ours */
+        mcs_lock_release(&pmm_lock);
+        bool drained = drain_caches();
+        mcs_lock_acquire(&pmm_lock);
+        if (!drained || !alloc_pages_locked(node, pages, &pfn))
         {
-            uint64_t start_bit = i * BITMAP_WORD_SIZE;
-            uint64_t consecutive = 0;
+            mcs_lock_release_irqrestore(&pmm_lock, flags);
+            return NULL;
+        }
+    }
+
+    mcs_lock_release_irqrestore(&pmm_lock, flags);
 
-            for (uint64_t j = 0; j < BITMAP_WORD_SIZE && start_bit + j < bitmap_pages; j++)
+    void *addr = (void *)(pfn * PAGE_SIZE);
+    return higher_half ? (void *)((uint64_t)addr + hhdm_offset) : addr;
+}
+
+/* Searches the zones below limit_pfn for an aligned run, pmm_lock held */
+static bool alloc_contig_locked(size_t pages, uint32_t order, uint64_t align_pages, uint64_t limit_pfn, uint64_t *out)
+{
+    /* Buddy blocks are naturally aligned, so any block of `order` already satisfies `align` */
+    if (order <= PMM_MAX_ORDER)
+    {
+        for (int type = ZONE_NORMAL; type >= ZONE_DMA; type--)
+        {
+            for (uint32_t i = 0; i < zone_count; i++)
             {
-                if (!bitmap_get(bitmap, start_bit + j))
+                if (zones[i].type != (uint32_t)type || zones[i].start_pfn + pages > limit_pfn)
+                    continue;
+                if (buddy_alloc_below(&zones[i], order, limit_pfn, out))
                 {
-                    if (++consecutive == pages)
-                    {
-                        for (uint64_t k = 0; k < pages; k++)
-                        {
-                            bitmap_set(bitmap, start_bit + j - pages + 1 + k);
-                        }
-                        free_pages -= pages;
-
-                        void *addr = (void *)((start_bit + j - pages + 1) * PAGE_SIZE);
-                        spinlock_release(&pmm_lock);
-                        return higher_half ? (void *)((uint64_t)addr + hhdm_offset) : addr;
-                    }
-                }
-                else
-                {
-                    consecutive = 0;
+                    if ((1ULL << order) > pages)
+                        buddy_free_range(*out + pages, (1ULL << order) - pages);
+                    mark_used(*out, pages);
+                    return true;
                 }
             }
         }
     }
 
-    spinlock_release(&pmm_lock);
-    return NULL;
+    if (!find_free_run(pages, align_pages, limit_pfn, out))
+        return false;
+
+    buddy_carve_range(*out, pages);
+    mark_used(*out, pages);
+    return true;
+}
+
+void *pmm_alloc_contig(size_t pages, size_t align, uint64_t max_phys)
+{
+    /* Not checked against free_pages, that doesn't count what's sitting in magazines */
+    if (pages == 0)
+        return NULL;
+
+    if (align < PAGE_SIZE)
+        align = PAGE_SIZE;
+    if (align & (align - 1))
+    {
+        err("pmm_alloc_contig: alignment 0x%llx is not a power of two", (uint64_t)align);
+        return NULL;
+    }
+
+    uint64_t align_pages = align / PAGE_SIZE;
+    uint64_t limit_pfn = max_phys ? max_phys / PAGE_SIZE : bitmap_pages;
+    uint32_t order = order_for_pages(pages);
+    uint32_t align_order = __builtin_ctzll(align_pages);
+    if (align_order > order)
+        order = align_order;
+
+    uint64_t flags = mcs_lock_acquire_irqsave(&pmm_lock);
+
+    uint64_t pfn;
+    bool found = alloc_contig_locked(pages, order, align_pages, limit_pfn, &pfn);
+    if (!found)
+    {
+        /* Same fallback as pmm_request_pages_node, cached pages may be what splits the run */
+        mcs_lock_release(&pmm_lock);
+        bool drained = drain_caches();
+        mcs_lock_acquire(&pmm_lock);
+        found = drained && alloc_contig_locked(pages, order, align_pages, limit_pfn, &pfn);
+    }
+
+    mcs_lock_release_irqrestore(&pmm_lock, flags);
+
+    return found ? (void *)(pfn * PAGE_SIZE) : NULL;
 }
 
 void pmm_release_pages(void *ptr, size_t pages)
@@ -150,37 +891,212 @@ void pmm_release_pages(void *ptr, size_t pages)
     if (!ptr || !is_aligned(ptr, MIN_ALIGN))
         return;
 
-    spinlock_acquire(&pmm_lock);
-
     uint64_t start = ((uint64_t)ptr - (hhdm_offset * ((uint64_t)ptr >= hhdm_offset))) / PAGE_SIZE;
 
     if (start + pages > bitmap_pages)
+        return;
+
+    if (pages == 1)
     {
-        spinlock_release(&pmm_lock);
+        if (!bitmap_get(bitmap, start))
+            return;
+
+        /* Pages from another node go straight home so they never get handed out as local ones */
+        if (pmm_pages[start].node != numa_node_of_cpu(cpu_current_id()))
+        {
+            uint64_t flags = mcs_lock_acquire_irqsave(&pmm_lock);
+            bool cached = pmm_pages[start].flags & PG_MAGAZINE; // a refill that fell back can park remote pages too
+            if (!cached)
+            {
+                mark_free(start, 1);
+                buddy_free(zone_of(start), start, 0);
+            }
+            mcs_lock_release_irqrestore(&pmm_lock, flags);
+            if (cached)
+                warn("Double free of page 0x%llx", start * PAGE_SIZE);
+            return;
+        }
+        magazine_free(start);
         return;
     }
 
-    for (size_t i = 0; i < pages; i++)
+    uint64_t flags = mcs_lock_acquire_irqsave(&pmm_lock);
+
+    /* Only pages that are actually in use get freed, runs of them are coalesced together */
+    uint64_t run = 0;
+    for (size_t i = 0; i <= pages; i++)
     {
-        if (bitmap_get(bitmap, start + i))
+        if (i < pages && bitmap_get(bitmap, start + i))
         {
-            bitmap_clear(bitmap, start + i);
-            free_pages++;
+            run++;
+            continue;
+        }
 
-            if (pages == 1 && cache_index < cache_size)
-            {
-                page_cache[cache_index++] = start;
-            }
+        if (run)
+        {
+            uint64_t run_start = start + i - run;
+            mark_free(run_start, run);
+            buddy_free_range(run_start, run);
+            run = 0;
         }
     }
 
-    spinlock_release(&pmm_lock);
+    mcs_lock_release_irqrestore(&pmm_lock, flags);
+}
+
+/*
+ * Page sharing. A page starts out with one owner and a count of 0, every extra pagemap that maps
+ * it takes a reference. Pages without a descriptor (MMIO and such) are never counted.
+ */
+void pmm_page_ref(uint64_t phys)
+{
+    page_t *page = pmm_phys_to_page(phys);
+    if (page)
+        __atomic_fetch_add(&page->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Drops one owner, returns true if it was the last one and the caller should free the page */
+bool pmm_page_unref(uint64_t phys)
+{
+    page_t *page = pmm_phys_to_page(phys);
+    if (page == NULL)
+        return false;
+
+    uint32_t refs = __atomic_load_n(&page->refs, __ATOMIC_RELAXED);
+    do
+    {
+        if (refs == 0)
+            return true;
+    } while (!__atomic_compare_exchange_n(&page->refs, &refs, refs - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    return false;
+}
+
+bool pmm_page_shared(uint64_t phys)
+{
+    page_t *page = pmm_phys_to_page(phys);
+    return page && __atomic_load_n(&page->refs, __ATOMIC_ACQUIRE) != 0;
+}
+
+/* False for MMIO, firmware tables and holes, anything the PMM never hands out */
+bool pmm_is_ram(uint64_t phys)
+{
+    page_t *page = pmm_phys_to_page(phys);
+    return page && (page->flags & PG_RAM);
+}
+
+/* A cleared page, physical address like pmm_request_page. Comes from the zero pool when it can */
+void *pmm_request_zeroed_page(void)
+{
+    uint64_t flags = int_save_disable();
+    pmm_magazine_t *mag = &magazines[cpu_current_id()];
+    uint64_t pfn = zero_pool_pop();
+    if (pfn != NO_PAGE)
+        mag->stats.zero_hits++;
+    else
+        mag->stats.zero_misses++;
+    int_restore(flags);
+
+    if (pfn != NO_PAGE)
+        return (void *)(pfn * PAGE_SIZE);
+
+    void *page = pmm_request_page();
+    if (page)
+        zero_page_cached((uint64_t)page / PAGE_SIZE);
+    return page;
+}
+
+/* One idle-time pass: clears up to ZERO_POOL_BATCH free pages and parks them in the zero pool */
+void pmm_zero_worker(void)
+{
+    uint64_t batch[ZERO_POOL_BATCH];
+    uint32_t count = 0;
+    while (count < ZERO_POOL_BATCH && __atomic_load_n(&zero_count, __ATOMIC_RELAXED) + count < ZERO_POOL_TARGET &&
+           __atomic_load_n(&free_pages, __ATOMIC_RELAXED) > ZERO_POOL_RESERVE)
+    {
+        void *page = pmm_request_page();
+        if (page == NULL)
+            break;
+        batch[count++] = (uint64_t)page / PAGE_SIZE;
+    }
+
+    if (count == 0)
+        return;
+
+    for (uint32_t i = 0; i < count; i++)
+        zero_page_nt(batch[i]);
+    __asm__ volatile("sfence" ::: "memory"); // movnti is weakly ordered, the zeroes must land before anyone gets the page
+
+    uint64_t flags = spinlock_acquire_irqsave(&zero_lock);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        page_t *page = &pmm_pages[batch[i]];
+        page->next = zero_pool;
+        zero_pool = page;
+    }
+    zero_count += count;
+    spinlock_release_irqrestore(&zero_lock, flags);
+}
+
+/* The memmap entry it came from no longer covers it, so vmm_init has to map it by itself */
+void pmm_get_metadata(uint64_t *base, uint64_t *length)
+{
+    *base = meta_phys;
+    *length = meta_length;
+}
+
+uint64_t pmm_get_total_pages(void)
+{
+    return bitmap_pages;
 }
 
 uint64_t pmm_get_free_pages(void)
 {
-    spinlock_acquire(&pmm_lock);
-    uint64_t count = free_pages;
-    spinlock_release(&pmm_lock);
+    /* A snapshot either way, the magazines move without pmm_lock too */
+    uint64_t count = __atomic_load_n(&free_pages, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < CPU_MAX; i++)
+        count += __atomic_load_n(&magazines[i].count, __ATOMIC_RELAXED);
     return count;
-}
\ No newline at end of file
+}
+
+void pmm_get_cpu_stats(uint32_t cpu, pmm_cpu_stats_t *out)
+{
+    if (cpu >= CPU_MAX || out == NULL)
+        return;
+
+    pmm_magazine_t *mag = &magazines[cpu];
+    out->hits = __atomic_load_n(&mag->stats.hits, __ATOMIC_RELAXED);
+    out->misses = __atomic_load_n(&mag->stats.misses, __ATOMIC_RELAXED);
+    out->refills = __atomic_load_n(&mag->stats.refills, __ATOMIC_RELAXED);
+    out->drains = __atomic_load_n(&mag->stats.drains, __ATOMIC_RELAXED);
+    out->zero_hits = __atomic_load_n(&mag->stats.zero_hits, __ATOMIC_RELAXED);
+    out->zero_misses = __atomic_load_n(&mag->stats.zero_misses, __ATOMIC_RELAXED);
+}
+
+void pmm_dump_cpu_stats(void)
+{
+    for (uint32_t i = 0; i < CPU_MAX; i++)
+    {
+        pmm_cpu_stats_t stats;
+        pmm_get_cpu_stats(i, &stats);
+
+        uint64_t total = stats.hits + stats.misses;
+        if (total == 0)
+            continue;
+
+        mem("cpu%d: %llu allocs, hit %llu%%, miss %llu%%, %llu refills, %llu drains, %llu cached",
+            i, total, stats.hits * 100 / total, stats.misses * 100 / total,
+            stats.refills, stats.drains, magazines[i].count);
+        if (stats.zero_hits + stats.zero_misses)
+            mem("cpu%d: %llu zeroed pages from the pool, %llu cleared inline", i, stats.zero_hits, stats.zero_misses);
+    }
+    mem("Zero pool: %llu pages", __atomic_load_n(&zero_count, __ATOMIC_RELAXED));
+}
+
+void pmm_dump_zones(void)
+{
+    for (uint32_t i = 0; i < zone_count; i++)
+    {
+        mem("Zone %d: node %d %s, 0x%.16llx -> 0x%.16llx, %llu free pages", i, zones[i].node, zone_names[zones[i].type],
+            zones[i].start_pfn * PAGE_SIZE, zones[i].end_pfn * PAGE_SIZE, zones[i].free_pages);
+    }
+}
@@ -0,0 +1,275 @@
+#define LOG_MODULE "slab"
+#include <mm/slab.h>
+#include <mm/pmm.h>
+#include <lib/string.h>
+#include <sys/cpu.h>
+#include <sys/spinlock.h>
+#include <util/log.h>
+#include <util/memory.h>
+
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_CPU_CACHE 16 // objects kept per CPU in front of the slab lists
+#define SLAB_CPU_BATCH 8  // objects moved per refill or drain
+#define SLAB_MAX_EMPTY 1  // empty slabs kept around before going back to the PMM
+
+/* Lives at the start of the slab's own memory, slabs are aligned to their size */
+typedef struct slab
+{
+    struct slab *next;
+    struct slab *prev;
+    struct slab **list;
+    void *free;
+    uint32_t inuse;
+} slab_t;
+
+typedef struct
+{
+    uint32_t count;
+    void *objects[SLAB_CPU_CACHE];
+} slab_cpu_t;
+
+struct slab_cache
+{
+    const char *name;
+    size_t size;
+    size_t slot;     // object stride
+    size_t link_off; // where a free object keeps its free-list link
+    size_t offset;   // first object, past the slab header
+    size_t pages;    // per slab
+    uint32_t capacity;
+    slab_ctor_t ctor;
+
+    spinlock_t lock;
+    slab_t *partial;
+    slab_t *full;
+    slab_t *empty;
+    uint32_t empty_count;
+    uint64_t slab_count;
+    uint64_t inuse; // handed out of the slabs, per-CPU arrays included
+
+    slab_cpu_t cpu[CPU_MAX];
+    struct slab_cache *next;
+};
+
+static slab_cache_t *caches = NULL;
+static spinlock_t caches_lock = {0};
+
+static inline void **link_of(slab_cache_t *cache, void *obj)
+{
+    return (void **)((uint8_t *)obj + cache->link_off);
+}
+
+static inline slab_t *slab_of(slab_cache_t *cache, void *obj)
+{
+    return (slab_t *)ALIGN_DOWN((uint64_t)obj, cache->pages * PAGE_SIZE);
+}
+
+static void list_remove(slab_t *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *slab->list = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->list = NULL;
+}
+
+static void list_push(slab_t **list, slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list)
+        (*list)->prev = slab;
+    *list = slab;
+    slab->list = list;
+}
+
+static inline void list_move(slab_t **list, slab_t *slab)
+{
+    if (slab->list == list)
+        return;
+    list_remove(slab);
+    list_push(list, slab);
+}
+
+static slab_t *slab_grow(slab_cache_t *cache)
+{
+    /* Multi-page slabs are aligned to their size so slab_of() can find the header */
+    void *phys = cache->pages == 1 ? pmm_request_page() : pmm_alloc_contig(cache->pages, cache->pages * PAGE_SIZE, 0);
+    if (phys == NULL)
+        return NULL;
+
+    for (uint64_t i = 0; i < cache->pages; i++)
+    {
+        page_t *page = pmm_phys_to_page((uint64_t)phys + i * PAGE_SIZE);
+        page->flags |= PG_SLAB;
+        page->slab_cache = cache;
+    }
+
+    slab_t *slab = (slab_t *)HIGHER_HALF(phys);
+    slab->free = NULL;
+    slab->inuse = 0;
+    slab->list = NULL;
+
+    uint8_t *objects = (uint8_t *)slab + cache->offset;
+    for (uint32_t i = cache->capacity; i-- > 0;)
+    {
+        void *obj = objects + i * cache->slot;
+        if (cache->ctor)
+            cache->ctor(obj);
+        *link_of(cache, obj) = slab->free;
+        slab->free = obj;
+    }
+
+    list_push(&cache->empty, slab);
+    cache->empty_count++;
+    cache->slab_count++;
+    return slab;
+}
+
+/* Both of these are called with the cache lock held */
+static void *take_object(slab_cache_t *cache)
+{
+    slab_t *slab = cache->partial;
+    if (slab == NULL && (slab = cache->empty) == NULL && (slab = slab_grow(cache)) == NULL)
+        return NULL;
+
+    if (slab->list == &cache->empty)
+        cache->empty_count--;
+
+    void *obj = slab->free;
+    slab->free = *link_of(cache, obj);
+    slab->inuse++;
+    cache->inuse++;
+    list_move(slab->inuse == cache->capacity ? &cache->full : &cache->partial, slab);
+    return obj;
+}
+
+static void put_object(slab_cache_t *cache, void *obj)
+{
+    slab_t *slab = slab_of(cache, obj);
+    *link_of(cache, obj) = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+    cache->inuse--;
+
+    if (slab->inuse > 0)
+    {
+        list_move(&cache->partial, slab);
+        return;
+    }
+
+    if (cache->empty_count >= SLAB_MAX_EMPTY)
+    {
+        list_remove(slab);
+        cache->slab_count--;
+        for (uint64_t i = 0; i < cache->pages; i++)
+        {
+            page_t *page = pmm_phys_to_page((uint64_t)PHYSICAL(slab) + i * PAGE_SIZE);
+            page->flags &= ~PG_SLAB;
+            page->slab_cache = NULL;
+        }
+        pmm_release_pages(PHYSICAL(slab), cache->pages);
+        return;
+    }
+
+    list_move(&cache->empty, slab);
+    cache->empty_count++;
+}
+
+slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align, slab_ctor_t ctor)
+{
+    if (size == 0)
+        return NULL;
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+
+    slab_cache_t *cache = pmm_request_pages(DIV_ROUND_UP(sizeof(slab_cache_t), PAGE_SIZE), true);
+    if (cache == NULL)
+    {
+        err("Failed to allocate cache '%s'", name);
+        return NULL;
+    }
+    memset(cache, 0, sizeof(slab_cache_t));
+
+    /* Constructed objects keep their contents while free, so the link goes after them */
+    cache->name = name;
+    cache->size = size;
+    cache->ctor = ctor;
+    cache->link_off = ctor ? ALIGN_UP(size, sizeof(void *)) : 0;
+    cache->slot = ALIGN_UP(ctor ? cache->link_off + sizeof(void *) : (size < sizeof(void *) ? sizeof(void *) : size), align);
+    cache->offset = ALIGN_UP(sizeof(slab_t), align);
+
+    cache->pages = 1;
+    while ((cache->pages * PAGE_SIZE - cache->offset) / cache->slot < SLAB_MIN_OBJECTS)
+        cache->pages *= 2;
+    cache->capacity = (cache->pages * PAGE_SIZE - cache->offset) / cache->slot;
+    spinlock_init(&cache->lock);
+
+    uint64_t flags = spinlock_acquire_irqsave(&caches_lock);
+    cache->next = caches;
+    caches = cache;
+    spinlock_release_irqrestore(&caches_lock, flags);
+
+    mem("Created cache '%s': %llu byte objects, %u per %llu page slab", name, size, cache->capacity, cache->pages);
+    return cache;
+}
+
+void *slab_alloc(slab_cache_t *cache)
+{
+    uint64_t flags = int_save_disable();
+    slab_cpu_t *cpu = &cache->cpu[cpu_current_id()];
+
+    if (cpu->count == 0)
+    {
+        spinlock_acquire(&cache->lock);
+        while (cpu->count < SLAB_CPU_BATCH)
+        {
+            void *obj = take_object(cache);
+            if (obj == NULL)
+                break;
+            cpu->objects[cpu->count++] = obj;
+        }
+        spinlock_release(&cache->lock);
+    }
+
+    void *obj = cpu->count ? cpu->objects[--cpu->count] : NULL;
+    int_restore(flags);
+    return obj;
+}
+
+void slab_free(slab_cache_t *cache, void *obj)
+{
+    if (obj == NULL)
+        return;
+
+    uint64_t flags = int_save_disable();
+    slab_cpu_t *cpu = &cache->cpu[cpu_current_id()];
+
+    if (cpu->count == SLAB_CPU_CACHE)
+    {
+        spinlock_acquire(&cache->lock);
+        for (uint32_t i = 0; i < SLAB_CPU_BATCH; i++)
+            put_object(cache, cpu->objects[--cpu->count]);
+        spinlock_release(&cache->lock);
+    }
+
+    cpu->objects[cpu->count++] = obj;
+    int_restore(flags);
+}
+
+size_t slab_cache_size(slab_cache_t *cache)
+{
+    return cache->size;
+}
+
+void slab_dump_caches(void)
+{
+    SPINLOCK_GUARD(&caches_lock);
+    for (slab_cache_t *cache = caches; cache; cache = cache->next)
+    {
+        mem("%s: %llu byte objects (%llu byte slots), %llu slabs, %llu objects out",
+            cache->name, cache->size, cache->slot, cache->slab_count, cache->inuse);
+    }
+}
@@ -0,0 +1,423 @@
+#define LOG_MODULE "tlb"
+#include <mm/tlb.h>
+#include <mm/vmm.h>
+#include <lib/string.h>
+#include <sys/cpu.h>
+#include <sys/idt.h>
+#include <sys/lapic.h>
+#include <sys/seqlock.h>
+#include <sys/spinlock.h>
+#include <util/log.h>
+#include <util/memory.h>
+
+#define TLB_QUEUE_LEN 16
+
+#define CR4_PGE BIT(7)
+#define CR4_PCIDE BIT(17)
+#define CR3_NOFLUSH BIT(63)
+#define PCID_MAX 4095
+
+#define INVPCID_ADDRESS 0
+#define INVPCID_CONTEXT 1
+#define INVPCID_ALL_GLOBAL 2
+
+typedef struct
+{
+    uint64_t *pagemap; // NULL for kernel-half ranges
+    uint64_t start;
+    uint64_t pages;
+} tlb_range_t;
+
+/*
+ * Every CPU owns a queue of ranges other CPUs want it to drop. Senders append (merging with the
+ * last range when they touch), bump `requested` and IPI; the owner drains the queue and publishes
+ * the sequence it got to in `completed`. Overflowing the queue degrades to one full flush.
+ */
+typedef struct
+{
+    spinlock_t lock;
+    tlb_range_t queue[TLB_QUEUE_LEN];
+    uint32_t count;
+    bool flush_all;
+    uint64_t requested;
+    uint64_t completed;
+
+    uint64_t *active; // pagemap in CR3, read by senders to decide on lazy shootdown
+    uint64_t pcid_gen;
+    bool online;
+    uint32_t lapic_id;
+    tlb_stats_t stats;
+} tlb_cpu_t;
+
+static tlb_cpu_t tlb_cpus[CPU_MAX];
+static bool tlb_ready = false;
+
+/*
+ * PCIDs are handed out from a global counter. When it runs past PCID_MAX the generation is bumped
+ * and numbering restarts; pagemaps from an older generation get a fresh PCID on their next switch
+ * and each CPU drops its whole TLB the first time it sees the new generation. Every switch and
+ * remote flush reads a pagemap's (pcid, generation) pair, only the rare assignment writes it, so
+ * it sits behind a seqlock and the switch path never takes a lock once a pagemap has its PCID.
+ */
+static bool pcid_supported = false;
+static bool pcid_enabled = false;
+static bool invpcid_supported = false;
+static seqlock_t pcid_lock = {0};
+static uint64_t pcid_gen = 1;
+static uint16_t pcid_next = 1;
+
+/* Consistent (pcid, generation) pair, true when the PCID is from the current generation */
+static bool pcid_read(vmm_pagemap_meta_t *meta, uint16_t *pcid, uint64_t *gen)
+{
+    bool current;
+    uint32_t seq;
+    do
+    {
+        seq = seqlock_read_begin(&pcid_lock);
+        *gen = pcid_gen;
+        *pcid = meta->pcid;
+        current = meta->pcid_gen == *gen;
+    } while (seqlock_read_retry(&pcid_lock, seq));
+    return current;
+}
+
+static inline void invpcid(uint64_t type, uint16_t pcid, uint64_t virt)
+{
+    struct
+    {
+        uint64_t pcid;
+        uint64_t virt;
+    } desc = {pcid, virt};
+    __asm__ volatile("invpcid %0, %1" ::"m"(desc), "r"(type) : "memory");
+}
+
+/* Everything, global entries and every PCID included */
+static void flush_everything(tlb_cpu_t *self)
+{
+    if (invpcid_supported)
+        invpcid(INVPCID_ALL_GLOBAL, 0, 0);
+    else
+    {
+        uint64_t cr4 = read_cr4();
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    }
+    self->stats.full_flushes++;
+}
+
+static void flush_local(tlb_cpu_t *self, uint64_t *pagemap, uint64_t virt, uint64_t pages)
+{
+    uint32_t self_id = self - tlb_cpus;
+
+    /* Not loaded here: only entries still tagged with its PCID can be left over */
+    if (pagemap != NULL && pagemap != self->active)
+    {
+        if (!pcid_enabled)
+            return;
+
+        vmm_pagemap_meta_t *meta = vmm_pagemap_meta(pagemap);
+        if (meta == NULL)
+            return;
+        uint16_t pcid;
+        uint64_t gen;
+        if (!invpcid_supported || !pcid_read(meta, &pcid, &gen))
+        {
+            __atomic_fetch_or(&meta->stale_cpus, BIT(self_id), __ATOMIC_SEQ_CST);
+            return;
+        }
+
+        if (pages > TLB_FLUSH_THRESHOLD)
+        {
+            invpcid(INVPCID_CONTEXT, pcid, 0);
+            self->stats.full_flushes++;
+            return;
+        }
+
+        for (uint64_t i = 0; i < pages; i++)
+            invpcid(INVPCID_ADDRESS, pcid, virt + i * PAGE_SIZE);
+        self->stats.pages_flushed += pages;
+        return;
+    }
+
+    if (pages > TLB_FLUSH_THRESHOLD)
+    {
+        if (pagemap == NULL)
+            flush_everything(self);
+        else
+        {
+            write_cr3(read_cr3()); // no NOFLUSH bit, drops the current PCID
+            self->stats.full_flushes++;
+        }
+        return;
+    }
+
+    for (uint64_t i = 0; i < pages; i++)
+        invlpg(virt + i * PAGE_SIZE);
+    self->stats.pages_flushed += pages;
+}
+
+static void drain_queue(tlb_cpu_t *self)
+{
+    if (__atomic_load_n(&self->completed, __ATOMIC_ACQUIRE) == __atomic_load_n(&self->requested, __ATOMIC_ACQUIRE))
+        return;
+
+    tlb_range_t ranges[TLB_QUEUE_LEN];
+    spinlock_acquire(&self->lock);
+    uint64_t seq = self->requested;
+    uint32_t count = self->count;
+    bool flush_all = self->flush_all;
+    memcpy(ranges, self->queue, count * sizeof(tlb_range_t));
+    self->count = 0;
+    self->flush_all = false;
+    spinlock_release(&self->lock);
+
+    if (flush_all)
+        flush_everything(self);
+    else
+    {
+        for (uint32_t i = 0; i < count; i++)
+            flush_local(self, ranges[i].pagemap, ranges[i].start, ranges[i].pages);
+    }
+
+    __atomic_store_n(&self->completed, seq, __ATOMIC_RELEASE);
+}
+
+static void tlb_ipi_handler(struct register_ctx *ctx)
+{
+    (void)ctx;
+    tlb_cpu_t *self = &tlb_cpus[cpu_current_id()];
+    self->stats.ipis_received++;
+    drain_queue(self);
+    lapic_eoi();
+}
+
+/* Queues a range on a remote CPU, returns the sequence number to wait for */
+static uint64_t enqueue(tlb_cpu_t *cpu, uint64_t *pagemap, uint64_t virt, uint64_t pages)
+{
+    spinlock_acquire(&cpu->lock);
+    if (!cpu->flush_all)
+    {
+        tlb_range_t *last = cpu->count ? &cpu->queue[cpu->count - 1] : NULL;
+        if (pages > TLB_FLUSH_THRESHOLD && pagemap == NULL)
+            cpu->flush_all = true;
+        else if (last && last->pagemap == pagemap && virt <= last->start + last->pages * PAGE_SIZE && virt + pages * PAGE_SIZE >= last->start)
+        {
+            uint64_t start = virt < last->start ? virt : last->start;
+            uint64_t end = virt + pages * PAGE_SIZE;
+            if (end < last->start + last->pages * PAGE_SIZE)
+                end = last->start + last->pages * PAGE_SIZE;
+            last->start = start;
+            last->pages = (end - start) / PAGE_SIZE;
+        }
+        else if (cpu->count < TLB_QUEUE_LEN)
+            cpu->queue[cpu->count++] = (tlb_range_t){pagemap, virt, pages};
+        else
+            cpu->flush_all = true;
+    }
+    uint64_t seq = __atomic_add_fetch(&cpu->requested, 1, __ATOMIC_RELEASE);
+    spinlock_release(&cpu->lock);
+    return seq;
+}
+
+void tlb_cpu_setup()
+{
+    /* Features are probed once on the BSP, the APs are assumed to match and only program CR4 */
+    bool bsp = cpu_current_id() == 0;
+    if (bsp)
+    {
+        uint32_t eax, ebx, ecx, edx;
+        cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+        pcid_supported = (ecx & BIT(17)) != 0;
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        invpcid_supported = (ebx & BIT(10)) != 0;
+    }
+
+    uint64_t cr4 = read_cr4() | CR4_PGE;
+
+    /* PCIDE can only be turned on while CR3 is using PCID 0 */
+    if (pcid_supported && (read_cr3() & 0xFFF) == 0)
+        cr4 |= CR4_PCIDE;
+    write_cr4(cr4);
+    if (!bsp)
+        return;
+
+    pcid_enabled = (read_cr4() & CR4_PCIDE) != 0;
+    invpcid_supported = invpcid_supported && pcid_enabled;
+    mem("PCID %s, INVPCID %s", pcid_enabled ? "enabled" : "not supported", invpcid_supported ? "supported" : "not supported");
+}
+
+void tlb_init()
+{
+    uint32_t self = cpu_current_id();
+    tlb_register_cpu(self, lapic_id());
+
+    if (idt_register_handler(TLB_SHOOTDOWN_VECTOR, tlb_ipi_handler) != 0)
+    {
+        err("Failed to register shootdown handler, remote flushes disabled");
+        return;
+    }
+    tlb_ready = true;
+    info("TLB shootdown ready on vector 0x%x, flush threshold %u pages", TLB_SHOOTDOWN_VECTOR, TLB_FLUSH_THRESHOLD);
+}
+
+void tlb_register_cpu(uint32_t cpu, uint32_t lapic_id)
+{
+    if (cpu >= CPU_MAX)
+        return;
+
+    spinlock_init(&tlb_cpus[cpu].lock);
+    tlb_cpus[cpu].lapic_id = lapic_id;
+    __atomic_store_n(&tlb_cpus[cpu].online, true, __ATOMIC_RELEASE);
+}
+
+/* Returns the CR3 value to load for `pagemap`, called with interrupts off */
+uint64_t tlb_switch_pagemap(uint64_t *pagemap)
+{
+    uint32_t self_id = cpu_current_id();
+    tlb_cpu_t *self = &tlb_cpus[self_id];
+    uint64_t cr3 = (uint64_t)PHYSICAL(pagemap);
+
+    /*
+     * Published before anything else: a sender that still sees the old pagemap either marks us
+     * stale below, or (without PCIDs) relies on the CR3 load dropping everything anyway.
+     */
+    __atomic_store_n(&self->active, pagemap, __ATOMIC_SEQ_CST);
+    self->stats.switches++;
+    if (!pcid_enabled)
+        return cr3;
+
+    /* Not one of ours (the bootloader's), PCID 0 and a full flush */
+    vmm_pagemap_meta_t *meta = vmm_pagemap_meta(pagemap);
+    if (meta == NULL)
+        return cr3;
+
+    /* Interrupts are off here, and the flush IPI reads the same seqlock */
+    uint16_t pcid;
+    uint64_t gen;
+    if (!pcid_read(meta, &pcid, &gen))
+    {
+        seqlock_write_acquire(&pcid_lock);
+        if (meta->pcid_gen != pcid_gen)
+        {
+            if (pcid_next > PCID_MAX)
+            {
+                pcid_gen++;
+                pcid_next = 1;
+                mem("PCIDs exhausted, starting generation %llu", pcid_gen);
+            }
+            meta->pcid = pcid_next++;
+            meta->pcid_gen = pcid_gen;
+        }
+        pcid = meta->pcid;
+        gen = pcid_gen;
+        seqlock_write_release(&pcid_lock);
+    }
+
+    bool stale = (__atomic_fetch_and(&meta->stale_cpus, ~BIT(self_id), __ATOMIC_SEQ_CST) & BIT(self_id)) != 0;
+    if (self->pcid_gen != gen)
+    {
+        /* PCIDs from the last generation may have been handed out again */
+        flush_everything(self);
+        self->pcid_gen = gen;
+        stale = true;
+    }
+
+    cr3 |= pcid;
+    if (stale)
+        return cr3;
+
+    self->stats.switches_kept++;
+    return cr3 | CR3_NOFLUSH;
+}
+
+void tlb_shootdown(uint64_t *pagemap, uint64_t virt, uint64_t pages)
+{
+    if (pages == 0)
+        return;
+
+    uint64_t flags = int_save_disable();
+    uint32_t self_id = cpu_current_id();
+    tlb_cpu_t *self = &tlb_cpus[self_id];
+
+    /* Kernel-half mappings are global and shared by every pagemap, so every CPU may have them */
+    bool global = virt >= VMM_KERNEL_HALF;
+    uint64_t *target = global ? NULL : pagemap;
+    flush_local(self, target, virt, pages);
+
+    if (!tlb_ready)
+    {
+        int_restore(flags);
+        return;
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    vmm_pagemap_meta_t *meta = !global && pcid_enabled ? vmm_pagemap_meta(pagemap) : NULL;
+    uint64_t wait_for[CPU_MAX] = {0};
+    for (uint32_t i = 0; i < CPU_MAX; i++)
+    {
+        tlb_cpu_t *cpu = &tlb_cpus[i];
+        if (i == self_id || !__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE))
+            continue;
+
+        if (!global && __atomic_load_n(&cpu->active, __ATOMIC_SEQ_CST) != pagemap)
+        {
+            /* Mark first, then look again: a CPU switching in right now either sees the mark or gets the IPI */
+            if (meta)
+                __atomic_fetch_or(&meta->stale_cpus, BIT(i), __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&cpu->active, __ATOMIC_SEQ_CST) != pagemap)
+            {
+                self->stats.lazy_skips++;
+                continue;
+            }
+        }
+
+        wait_for[i] = enqueue(cpu, target, virt, pages);
+        lapic_send_ipi(cpu->lapic_id, TLB_SHOOTDOWN_VECTOR);
+        self->stats.ipis_sent++;
+    }
+
+    /* Keep serving our own queue while waiting, two CPUs may be shooting at each other */
+    for (uint32_t i = 0; i < CPU_MAX; i++)
+    {
+        while (wait_for[i] && __atomic_load_n(&tlb_cpus[i].completed, __ATOMIC_ACQUIRE) < wait_for[i])
+        {
+            drain_queue(self);
+            __asm__ volatile("pause");
+        }
+    }
+
+    int_restore(flags);
+}
+
+/* Serves our own queue, for code spinning with interrupts off on something a sender is holding */
+void tlb_poll(void)
+{
+    uint64_t flags = int_save_disable();
+    drain_queue(&tlb_cpus[cpu_current_id()]);
+    int_restore(flags);
+}
+
+bool tlb_get_stats(uint32_t cpu, tlb_stats_t *out)
+{
+    if (cpu >= CPU_MAX || out == NULL)
+        return false;
+
+    *out = tlb_cpus[cpu].stats;
+    return true;
+}
+
+void tlb_dump_stats()
+{
+    for (uint32_t i = 0; i < CPU_MAX; i++)
+    {
+        tlb_cpu_t *cpu = &tlb_cpus[i];
+        if (!cpu->online)
+            continue;
+
+        tlb_stats_t *s = &cpu->stats;
+        mem("cpu%u: %llu IPIs sent, %llu received, %llu pages flushed, %llu full flushes, %llu lazy skips",
+            i, s->ipis_sent, s->ipis_received, s->pages_flushed, s->full_flushes, s->lazy_skips);
+        mem("cpu%u: %llu pagemap switches, %llu kept the TLB", i, s->switches, s->switches_kept);
+    }
+}
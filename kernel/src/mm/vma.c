@@ -4,187 +4,500 @@
 #include <util/log.h>
 #include <util/memory.h>
 #include <sys/idt.h>
+#include <mm/slab.h>
+#include <sys/cpu.h>
 
 #define VMA_MIN_ADDRESS 0x1000
+#define VMA_MAX_ADDRESS 0x0000800000000000ULL // end of the lower half
 
-vma_context_t *vma_create_context(uint64_t *pagemap)
+#define PF_PRESENT BIT(0) // fault on a present page, i.e. a protection violation
+#define PF_WRITE BIT(1)
+
+/* Deeper than any balanced tree of 64-bit addresses, a lockless walk that gets this far is lost */
+#define VMA_WALK_MAX 128
+
+/* Pages unmapped per round before their frames are released, the addresses sit on the stack meanwhile */
+#define VMA_RELEASE_BATCH 256
+
+static slab_cache_t *region_cache = NULL;
+static slab_cache_t *context_cache = NULL;
+
+static inline uint64_t region_end(vma_region_t *region)
 {
-    vma_context_t *ctx = (vma_context_t *)HIGHER_HALF(pmm_request_page());
-    if (ctx == NULL)
+    return region->start + region->pages * PAGE_SIZE;
+}
+
+static inline vma_region_t *region_of(rb_node_t *node)
+{
+    return rb_entry_safe(node, vma_region_t, node);
+}
+
+static vma_region_t *region_alloc(void)
+{
+    vma_region_t *region = slab_alloc(region_cache);
+    if (region)
+        memset(region, 0, sizeof(vma_region_t));
+    return region;
+}
+
+static inline void region_free(vma_region_t *region)
+{
+    slab_free(region_cache, region);
+}
+
+static void region_free_rcu(rcu_head_t *head)
+{
+    region_free(rcu_entry(head, vma_region_t, rcu));
+}
+
+/*
+ * Regions live in a red-black tree keyed by start address. Each one records the free gap in front
+ * of it and the largest gap anywhere in its subtree, which is what lets the first-fit search skip
+ * whole subtrees that can't hold the request.
+ */
+static void region_augment(rb_node_t *node)
+{
+    vma_region_t *region = region_of(node);
+    uint64_t max_gap = region->gap;
+    if (node->left && region_of(node->left)->max_gap > max_gap)
+        max_gap = region_of(node->left)->max_gap;
+    if (node->right && region_of(node->right)->max_gap > max_gap)
+        max_gap = region_of(node->right)->max_gap;
+    region->max_gap = max_gap;
+}
+
+static void region_set_gap(vma_region_t *region, uint64_t prev_end)
+{
+    region->gap = region->start - prev_end;
+    rb_propagate(&region->node, region_augment);
+}
+
+/* Tree changes run inside ctx->seq so lockless lookups can tell they overlapped one */
+static void insert_region(vma_context_t *ctx, vma_region_t *region)
+{
+    seqcount_write_begin(&ctx->seq);
+    rb_node_t **link = &ctx->regions.node;
+    rb_node_t *parent = NULL;
+    while (*link)
     {
-        err("Failed to allocate VMA context");
-        return NULL;
+        parent = *link;
+        link = region->start < region_of(parent)->start ? &parent->left : &parent->right;
     }
-    memset(ctx, 0, sizeof(vma_context_t));
 
-    ctx->root = (vma_region_t *)HIGHER_HALF(pmm_request_page());
-    if (ctx->root == NULL)
+    rb_link(&region->node, parent, link);
+    vma_region_t *prev = region_of(rb_prev(&region->node));
+    region->gap = region->start - (prev ? region_end(prev) : ctx->base);
+    rb_insert(&ctx->regions, &region->node, region_augment);
+
+    vma_region_t *next = region_of(rb_next(&region->node));
+    if (next)
+        region_set_gap(next, region_end(region));
+    seqcount_write_end(&ctx->seq);
+}
+
+static void remove_region(vma_context_t *ctx, vma_region_t *region)
+{
+    __atomic_store_n(&region->dead, true, __ATOMIC_RELEASE);
+    seqcount_write_begin(&ctx->seq);
+    vma_region_t *next = region_of(rb_next(&region->node));
+    uint64_t prev_end = region->start - region->gap;
+
+    rb_erase(&ctx->regions, &region->node, region_augment);
+    if (next)
+        region_set_gap(next, prev_end);
+    seqcount_write_end(&ctx->seq);
+}
+
+/* Lowest address with `size` free bytes, either in front of some region or after the last one */
+static uint64_t find_gap(vma_context_t *ctx, uint64_t size)
+{
+    rb_node_t *node = ctx->regions.node;
+    if (node && region_of(node)->max_gap >= size)
+    {
+        while (node)
+        {
+            if (node->left && region_of(node->left)->max_gap >= size)
+            {
+                node = node->left;
+                continue;
+            }
+
+            vma_region_t *region = region_of(node);
+            if (region->gap >= size)
+                return region->start - region->gap;
+            node = node->right;
+        }
+    }
+
+    vma_region_t *last = region_of(rb_last(&ctx->regions));
+    uint64_t start = last ? region_end(last) : ctx->base;
+    return ctx->limit - start >= size ? start : 0;
+}
+
+/*
+ * Gives back the physical pages behind [start, start + pages), a contiguous run at a time. Each
+ * batch is unmapped and shot down before its frames are touched: until then other CPUs can still
+ * write through stale entries. Pages still shared with a clone only lose a reference, whoever
+ * unmaps them last frees them.
+ */
+static void vma_release_region(vma_context_t *ctx, uint64_t start, uint64_t pages)
+{
+    uint64_t frames[VMA_RELEASE_BATCH];
+    for (uint64_t done = 0; done < pages;)
+    {
+        uint64_t count = pages - done < VMA_RELEASE_BATCH ? pages - done : VMA_RELEASE_BATCH;
+        uint64_t virt = start + done * PAGE_SIZE;
+        for (uint64_t i = 0; i < count; i++)
+            frames[i] = virt_to_phys(ctx->pagemap, virt + i * PAGE_SIZE);
+        vmm_unmap_range(ctx->pagemap, virt, count * PAGE_SIZE);
+
+        uint64_t run_phys = 0;
+        uint64_t run = 0;
+        for (uint64_t i = 0; i <= count; i++)
+        {
+            uint64_t phys = i < count ? frames[i] : 0;
+            if (phys != 0 && !pmm_page_unref(phys))
+                phys = 0;
+            if (phys != 0 && run && phys == run_phys + run * PAGE_SIZE)
+            {
+                run++;
+                continue;
+            }
+
+            if (run)
+                pmm_release_pages((void *)run_phys, run);
+            run_phys = phys;
+            run = phys != 0;
+        }
+        done += count;
+    }
+}
+
+/*
+ * Backs a region with physical memory in chunks as big as the PMM will hand out, so each chunk
+ * is a single vmm_map_range call (and can end up on huge pages when it lines up).
+ */
+static bool vma_back_region(vma_context_t *ctx, vma_region_t *region)
+{
+    uint64_t done = 0;
+    uint64_t chunk = region->pages < 512 ? region->pages : 512;
+    while (done < region->pages)
+    {
+        if (chunk > region->pages - done)
+            chunk = region->pages - done;
+
+        uint64_t phys = (uint64_t)pmm_request_pages(chunk, false);
+        if (phys == 0)
+        {
+            if (chunk > 1)
+            {
+                chunk /= 2;
+                continue;
+            }
+
+            err("Failed to allocate physical memory for VMA region");
+            vma_release_region(ctx, region->start, done);
+            return false;
+        }
+
+        uint64_t virt = region->start + done * PAGE_SIZE;
+        if (!vmm_map_range(ctx->pagemap, virt, phys, chunk * PAGE_SIZE, region->flags & ~VMA_LAZY))
+        {
+            /* Part of the chunk may be mapped already, take it back down before the pages go */
+            vmm_unmap_range(ctx->pagemap, virt, chunk * PAGE_SIZE);
+            pmm_release_pages((void *)phys, chunk);
+            err("Failed to map VMA region");
+            vma_release_region(ctx, region->start, done);
+            return false;
+        }
+        done += chunk;
+    }
+
+    return true;
+}
+
+/* Backs one page of a lazy region or breaks COW sharing, returns false if the fault isn't ours to fix */
+static bool vma_handle_fault(uint64_t addr, uint64_t error)
+{
+    if (addr >= VMM_KERNEL_HALF)
+        return false;
+
+    uint64_t *pagemap = (uint64_t *)HIGHER_HALF(read_cr3() & PAGE_MASK);
+    if (error & PF_PRESENT)
+        return (error & PF_WRITE) && vmm_handle_cow(pagemap, addr);
+
+    vmm_pagemap_meta_t *meta = vmm_pagemap_meta(pagemap);
+    if (meta == NULL)
+        return false;
+
+    /*
+     * No lock. The read-side section covers the map too: vma_free waits out a grace period between
+     * marking a lazy region dead and unmapping it, so nothing we map here can outlive the region.
+     */
+    rcu_read_lock();
+    vma_context_t *ctx = rcu_dereference(meta->vma);
+    vma_region_t *region = ctx ? vma_find_region(ctx, addr) : NULL;
+    if (region == NULL || !(region->flags & VMA_LAZY) || __atomic_load_n(&region->dead, __ATOMIC_ACQUIRE))
+    {
+        rcu_read_unlock();
+        return false;
+    }
+
+    void *page = pmm_request_zeroed_page();
+    if (page == NULL)
+    {
+        rcu_read_unlock();
+        err("Out of memory backing 0x%.16llx", addr);
+        return false;
+    }
+
+    /* Another CPU touching the same page may have beaten us to it */
+    int mapped = vmm_map_if_unmapped(pagemap, ALIGN_DOWN(addr, PAGE_SIZE), (uint64_t)page, region->flags & ~VMA_LAZY);
+    if (mapped <= 0)
+        pmm_release_pages(page, 1);
+    rcu_read_unlock();
+    if (mapped < 0)
+    {
+        err("Out of memory mapping 0x%.16llx", addr);
+        return false;
+    }
+    return true;
+}
+
+static void page_fault_handler(struct register_ctx *ctx)
+{
+    if (!vma_handle_fault(ctx->cr2, ctx->err))
+        kpanic(ctx, NULL);
+}
+
+void vma_init()
+{
+    region_cache = slab_cache_create("vma_region", sizeof(vma_region_t), 0, NULL);
+    context_cache = slab_cache_create("vma_context", sizeof(vma_context_t), 0, NULL);
+    if (region_cache == NULL || context_cache == NULL)
+    {
+        err("Failed to create VMA caches");
+        hcf();
+    }
+
+    if (idt_register_handler(14, page_fault_handler) != 0)
+        err("Failed to register page fault handler, lazy regions will panic on touch");
+}
+
+vma_context_t *vma_create_context(uint64_t *pagemap)
+{
+    vma_context_t *ctx = context_cache ? slab_alloc(context_cache) : NULL;
+    if (ctx == NULL)
     {
-        err("Failed to allocate root region");
-        pmm_release_pages((void *)PHYSICAL(ctx), 1);
+        err("Failed to allocate VMA context");
         return NULL;
     }
 
+    memset(ctx, 0, sizeof(vma_context_t));
+    rwlock_init(&ctx->lock);
+    seqcount_init(&ctx->seq);
     ctx->pagemap = pagemap;
-    ctx->root->start = VMA_MIN_ADDRESS;
-    ctx->root->pages = 0;
+    ctx->base = VMA_MIN_ADDRESS;
+    ctx->limit = VMA_MAX_ADDRESS;
+
+    vmm_pagemap_meta_t *meta = vmm_pagemap_meta(pagemap);
+    if (meta)
+        rcu_assign_pointer(meta->vma, ctx);
     return ctx;
 }
 
 void vma_destroy_context(vma_context_t *ctx)
 {
     info("Destroying VMA context at 0x%.16llx", (uint64_t)ctx);
-    if (ctx->root == NULL || ctx->pagemap == NULL)
+    if (ctx == NULL || ctx->pagemap == NULL)
     {
-        err("Invalid context or root passed to vma_destroy_context");
+        err("Invalid context passed to vma_destroy_context");
         return;
     }
 
-    vma_region_t *region = ctx->root;
-    while (region != NULL)
+    /* Unhooked first, once a grace period has passed no fault can still be looking at it */
+    vmm_pagemap_meta_t *meta = vmm_pagemap_meta(ctx->pagemap);
+    if (meta && meta->vma == ctx)
+    {
+        rcu_assign_pointer(meta->vma, NULL);
+        synchronize_rcu();
+    }
+
+    vma_region_t *region;
+    rwlock_write_acquire(&ctx->lock);
+    while ((region = region_of(rb_first(&ctx->regions))) != NULL)
     {
-        info("Freeing region at 0x%.16llx", (uint64_t)region);
-        vma_region_t *next = region->next;
-        pmm_release_pages((void *)PHYSICAL(region), 1);
-        region = next;
+        info("Freeing region at 0x%.16llx", (uint64_t)region->start);
+        vma_release_region(ctx, region->start, region->pages);
+        remove_region(ctx, region);
+        region_free(region);
     }
+    rwlock_write_release(&ctx->lock);
 
-    pmm_release_pages((void *)PHYSICAL(ctx), 1);
+    slab_free(context_cache, ctx);
     info("Destroyed VMA context at 0x%.16llx", (uint64_t)ctx);
 }
 
-void *vma_alloc(vma_context_t *ctx, uint64_t pages, uint64_t flags)
+/*
+ * Fork: a new pagemap sharing every page with ctx's copy-on-write, plus a copy of its regions.
+ * Costs a walk over the page tables, nothing gets copied until somebody writes.
+ */
+vma_context_t *vma_fork_context(vma_context_t *ctx)
 {
-    if (ctx == NULL || ctx->root == NULL || ctx->pagemap == NULL)
+    if (ctx == NULL || ctx->pagemap == NULL)
     {
-        err("Invalid context or root passed to vma_alloc");
+        err("Invalid context passed to vma_fork_context");
         return NULL;
     }
 
-    vma_region_t *region = ctx->root;
-    vma_region_t *new_region;
-    vma_region_t *last_region = ctx->root;
-
-    while (region != NULL)
+    /* Read side is enough, the regions and the tables just can't change while they're copied */
+    rwlock_read_acquire(&ctx->lock);
+    uint64_t *pagemap = vmm_clone_pagemap(ctx->pagemap);
+    if (pagemap == NULL)
     {
-        if (region->next == NULL || region->start + region->pages < region->next->start)
-        {
-            new_region = (vma_region_t *)HIGHER_HALF(pmm_request_page());
-            if (new_region == NULL)
-            {
-                err("Failed to allocate new VMA region");
-                return NULL;
-            }
-
-            memset(new_region, 0, sizeof(vma_region_t));
-            new_region->pages = pages;
-            new_region->flags = flags;
-            new_region->start = region->start + region->pages;
-            new_region->next = region->next;
-            new_region->prev = region;
-            region->next = new_region;
-
-            for (uint64_t i = 0; i < pages; i++)
-            {
-                uint64_t page = (uint64_t)pmm_request_page();
-                if (page == 0)
-                {
-                    err("Failed to allocate physical memory for VMA region");
-                    return NULL;
-                }
-
-                vmm_map(ctx->pagemap, new_region->start + i * PAGE_SIZE, page, new_region->flags);
-            }
-
-            return (void *)new_region->start;
-        }
-        region = region->next;
+        rwlock_read_release(&ctx->lock);
+        return NULL;
     }
 
-    new_region = (vma_region_t *)HIGHER_HALF(pmm_request_page());
-    if (new_region == NULL)
+    vma_context_t *child = vma_create_context(pagemap);
+    if (child == NULL)
     {
-        err("Failed to allocate new VMA region");
+        rwlock_read_release(&ctx->lock);
+        vmm_destroy_pagemap(pagemap);
         return NULL;
     }
+    child->base = ctx->base;
+    child->limit = ctx->limit;
 
-    memset(new_region, 0, sizeof(vma_region_t));
-
-    last_region->next = new_region;
-    new_region->prev = last_region;
-    new_region->start = last_region->start + last_region->pages;
-    new_region->pages = pages;
-    new_region->flags = flags;
-    new_region->next = NULL;
-
-    for (uint64_t i = 0; i < pages; i++)
+    /* Appending in order, so every region lands as the rightmost node with its gap already right */
+    for (vma_region_t *region = region_of(rb_first(&ctx->regions)); region; region = region_of(rb_next(&region->node)))
     {
-        uint64_t page = (uint64_t)pmm_request_page();
-        if (page == 0)
+        vma_region_t *copy = region_alloc();
+        if (copy == NULL)
         {
-            err("Failed to allocate physical memory for VMA region");
+            err("Failed to copy VMA region at 0x%.16llx", region->start);
+            for (; region; region = region_of(rb_next(&region->node)))
+                vma_release_region(child, region->start, region->pages); // drop the references the clone took
+            rwlock_read_release(&ctx->lock);
+            vma_destroy_context(child);
+            vmm_destroy_pagemap(pagemap);
             return NULL;
         }
 
-        vmm_map(ctx->pagemap, new_region->start + i * PAGE_SIZE, page, new_region->flags);
+        copy->start = region->start;
+        copy->pages = region->pages;
+        copy->flags = region->flags;
+        insert_region(child, copy);
     }
+    rwlock_read_release(&ctx->lock);
 
-    return (void *)new_region->start;
+    return child;
 }
 
-void vma_free(vma_context_t *ctx, void *ptr)
+/*
+ * Lockless walk. A rotation running alongside can send it down the wrong subtree, but never to a
+ * freed node, so a hit is always right and a miss is only trusted if no tree change overlapped it.
+ */
+static vma_region_t *lookup_region(vma_context_t *ctx, uint64_t addr)
 {
-    if (ctx == NULL)
+    rb_node_t *node = __atomic_load_n(&ctx->regions.node, __ATOMIC_ACQUIRE);
+    for (uint32_t depth = 0; node && depth < VMA_WALK_MAX; depth++)
     {
-        err("Invalid context passed to vma_free");
-        return;
+        vma_region_t *region = region_of(node);
+        if (addr < region->start)
+            node = __atomic_load_n(&node->left, __ATOMIC_ACQUIRE);
+        else if (addr >= region_end(region))
+            node = __atomic_load_n(&node->right, __ATOMIC_ACQUIRE);
+        else
+            return region;
     }
+    return NULL;
+}
 
-    vma_region_t *region = ctx->root;
-    while (region != NULL)
+vma_region_t *vma_find_region(vma_context_t *ctx, uint64_t addr)
+{
+    for (;;)
     {
-        if (region->start == (uint64_t)ptr)
-        {
-            break;
-        }
-        region = region->next;
+        uint32_t seq = seqcount_read_begin(&ctx->seq);
+        vma_region_t *region = lookup_region(ctx, addr);
+        if (region || !seqcount_read_retry(&ctx->seq, seq))
+            return region;
     }
+}
 
-    if (region == NULL)
+void *vma_alloc(vma_context_t *ctx, uint64_t pages, uint64_t flags)
+{
+    if (ctx == NULL || ctx->pagemap == NULL)
     {
-        err("Unable to find region to free at address 0x%.16llx", (uint64_t)ptr);
-        return;
+        err("Invalid context passed to vma_alloc");
+        return NULL;
     }
 
-    vma_region_t *prev = region->prev;
-    vma_region_t *next = region->next;
+    vma_region_t *region = region_cache ? region_alloc() : NULL;
+    if (region == NULL)
+    {
+        err("Failed to allocate new VMA region");
+        return NULL;
+    }
 
-    for (uint64_t i = 0; i < region->pages; i++)
+    rwlock_write_acquire(&ctx->lock);
+    uint64_t start = find_gap(ctx, pages * PAGE_SIZE);
+    if (start == 0)
     {
-        uint64_t virt = region->start + i * PAGE_SIZE;
-        uint64_t phys = virt_to_phys(kernel_pagemap, virt);
+        rwlock_write_release(&ctx->lock);
+        region_free(region);
+        err("No free virtual range for %llu pages", pages);
+        return NULL;
+    }
 
-        if (phys != 0)
-        {
-            pmm_release_pages((void *)phys, 1);
-            vmm_unmap(ctx->pagemap, virt);
-        }
+    region->start = start;
+    region->pages = pages;
+    region->flags = flags;
+    insert_region(ctx, region);
+    rwlock_write_release(&ctx->lock);
+
+    /* The range is ours once it's in the tree, backing it doesn't need to hold up lookups */
+    if (!(flags & VMA_LAZY) && !vma_back_region(ctx, region))
+    {
+        rwlock_write_acquire(&ctx->lock);
+        remove_region(ctx, region);
+        rwlock_write_release(&ctx->lock);
+        call_rcu(&region->rcu, region_free_rcu);
+        return NULL;
     }
 
-    if (prev != NULL)
+    return (void *)start;
+}
+
+void vma_free(vma_context_t *ctx, void *ptr)
+{
+    if (ctx == NULL)
     {
-        prev->next = next;
+        err("Invalid context passed to vma_free");
+        return;
     }
 
-    if (next != NULL)
+    /* Unmapped before it leaves the tree, or a new allocation could land on pages still mapped */
+    rwlock_write_acquire(&ctx->lock);
+    vma_region_t *region = vma_find_region(ctx, (uint64_t)ptr);
+    if (region == NULL || region->start != (uint64_t)ptr || region->dead)
     {
-        next->prev = prev;
+        rwlock_write_release(&ctx->lock);
+        err("Unable to find region to free at address 0x%.16llx", (uint64_t)ptr);
+        return;
     }
 
-    if (region == ctx->root)
+    /* Faults map lazy pages without any lock, let the ones that already found this region finish */
+    __atomic_store_n(&region->dead, true, __ATOMIC_RELEASE);
+    if (region->flags & VMA_LAZY)
     {
-        ctx->root = next;
+        rwlock_write_release(&ctx->lock);
+        synchronize_rcu();
+        rwlock_write_acquire(&ctx->lock);
     }
 
-    pmm_release_pages((void *)PHYSICAL(region), 1);
-}
\ No newline at end of file
+    vma_release_region(ctx, region->start, region->pages);
+    remove_region(ctx, region);
+    rwlock_write_release(&ctx->lock);
+    call_rcu(&region->rcu, region_free_rcu);
+}
@@ -3,11 +3,25 @@
 #include <boot/boot.h>
 #include <lib/string.h>
 #include <mm/pmm.h>
+#include <mm/tlb.h>
+#include <mm/slab.h>
+#include <sys/rcu.h>
+#include <sys/rwlock.h>
+#include <sys/spinlock.h>
 #include <util/log.h>
 #include <sys/cpu.h>
 #include <util/memory.h>
 
 uint64_t *kernel_pagemap;
+static bool huge_1g_supported = false;
+static uint64_t table_pages = 0;
+
+/* Pagemap metadata, hashed by PML4 physical address. Lookups walk under RCU, entries are published whole */
+#define PAGEMAP_BUCKETS 64
+static vmm_pagemap_meta_t *pagemap_buckets[PAGEMAP_BUCKETS];
+static spinlock_t pagemap_lock = {0};
+static slab_cache_t *pagemap_meta_cache = NULL;
+static vmm_pagemap_meta_t *kernel_meta = NULL; // its lock covers the kernel half of every pagemap
 
 /* External symbols, defined in linker script (hopefully) */
 extern char __limine_requests_start[];
@@ -33,20 +47,329 @@ static inline uint64_t *get_table(uint64_t *table, uint64_t index)
     return (uint64_t *)HIGHER_HALF(table[index] & PAGE_MASK);
 }
 
-static inline uint64_t *get_or_alloc_table(uint64_t *table, uint64_t index, uint64_t flags)
+/* Present entries in a page-table page, kept in its page descriptor */
+static inline uint16_t *table_count(uint64_t *table)
+{
+    return &pmm_phys_to_page((uint64_t)PHYSICAL(table))->table_used;
+}
+
+/* Every entry write goes through here so the occupancy counts stay right */
+static inline void set_entry(uint64_t *table, uint64_t index, uint64_t value)
+{
+    int was = (table[index] & VMM_PRESENT) != 0;
+    int is = (value & VMM_PRESENT) != 0;
+    table[index] = value;
+    *table_count(table) += is - was;
+}
+
+/* NULL when out of memory, every caller has to pass that up */
+static inline uint64_t *alloc_table(void)
+{
+    void *page = pmm_request_zeroed_page();
+    if (page == NULL)
+        return NULL;
+
+    uint64_t *pml = HIGHER_HALF(page);
+    pmm_phys_to_page((uint64_t)PHYSICAL(pml))->flags |= PG_TABLE;
+    *table_count(pml) = 0;
+    table_pages++;
+    return pml;
+}
+
+static inline void release_table(uint64_t *table)
+{
+    page_t *page = pmm_phys_to_page((uint64_t)PHYSICAL(table));
+    page->flags &= ~PG_TABLE;
+    page->table_used = 0;
+    pmm_release_pages(PHYSICAL(table), 1);
+    table_pages--;
+}
+
+/*
+ * What a change to the tables leaves for after the write lock is dropped: the range whose cached
+ * translations went stale, and table pages (linked through their descriptors) that other CPUs may
+ * still be walking until that range is shot down.
+ */
+typedef struct
+{
+    uint64_t start;
+    uint64_t end; // same as start when nothing needs flushing
+    page_t *deferred;
+} vmm_flush_t;
+
+static inline void flush_add(vmm_flush_t *flush, uint64_t virt, uint64_t size)
+{
+    if (flush->start == flush->end)
+    {
+        flush->start = virt;
+        flush->end = virt + size;
+        return;
+    }
+    if (virt < flush->start)
+        flush->start = virt;
+    if (virt + size > flush->end)
+        flush->end = virt + size;
+}
+
+/*
+ * Replaces the huge entry covering virt with a table of 512 entries of the next size down. The
+ * translation is the same, but the huge TLB entry must not outlive whatever changes below it next;
+ * invlpg on any address inside drops the whole thing, so queueing virt is enough.
+ */
+static bool split_huge(uint64_t *table, uint64_t index, uint64_t virt, uint64_t size, vmm_flush_t *flush)
+{
+    uint64_t entry = table[index];
+    uint64_t base = entry & PAGE_MASK & ~(size - 1);
+    uint64_t child_size = size / 512;
+    uint64_t child_flags = entry & ~PAGE_MASK & ~VMM_HUGE;
+    if (child_size != PAGE_SIZE)
+        child_flags |= VMM_HUGE;
+
+    uint64_t *pml = alloc_table();
+    if (pml == NULL)
+        return false;
+    for (uint64_t i = 0; i < 512; i++)
+        pml[i] = (base + i * child_size) | child_flags;
+    *table_count(pml) = 512;
+
+    table[index] = (uint64_t)PHYSICAL(pml) | 0b111;
+    flush_add(flush, ALIGN_DOWN(virt, PAGE_SIZE), PAGE_SIZE);
+    return true;
+}
+
+/* Queues a table for release_deferred. The link goes in its descriptor, the table may still be walked */
+static inline void defer_table(uint64_t *table, page_t **deferred)
+{
+    page_t *page = pmm_phys_to_page((uint64_t)PHYSICAL(table));
+    page->next = *deferred;
+    *deferred = page;
+}
+
+/* Queues a page table and every table below it on `deferred`, but not the pages they map */
+static void defer_table_tree(uint64_t *table, int level, page_t **deferred)
+{
+    if (level > 1)
+    {
+        for (uint64_t i = 0; i < 512; i++)
+        {
+            if ((table[i] & VMM_PRESENT) && !(table[i] & VMM_HUGE))
+                defer_table_tree(get_table(table, i), level - 1, deferred);
+        }
+    }
+    defer_table(table, deferred);
+}
+
+static inline uint64_t *get_or_alloc_table(uint64_t *table, uint64_t index, uint64_t virt, uint64_t flags, uint64_t size,
+                                           vmm_flush_t *flush)
 {
     if (!(table[index] & VMM_PRESENT))
     {
-        uint64_t *pml = HIGHER_HALF(pmm_request_page());
-        memset(pml, 0, PAGE_SIZE);
-        table[index] = (uint64_t)PHYSICAL(pml) | 0b111;
+        uint64_t *pml = alloc_table();
+        if (pml == NULL)
+            return NULL;
+        set_entry(table, index, (uint64_t)PHYSICAL(pml) | 0b111);
     }
-    table[index] |= flags & 0xFF;
+    else if ((table[index] & VMM_HUGE) && !split_huge(table, index, virt, size, flush))
+    {
+        return NULL;
+    }
+    table[index] |= flags & (VMM_PRESENT | VMM_WRITE | VMM_USER);
     return (uint64_t *)HIGHER_HALF(table[index] & PAGE_MASK);
 }
 
+/* Installs a huge leaf at virt. Whatever used to be mapped there gets flushed, its tables freed after that */
+static inline void set_huge(uint64_t *table, uint64_t index, uint64_t virt, uint64_t phys, uint64_t flags, int child_level,
+                            vmm_flush_t *flush)
+{
+    if (table[index] & VMM_PRESENT)
+    {
+        uint64_t size = child_level == 2 ? PAGE_SIZE_1G : PAGE_SIZE_2M;
+        flush_add(flush, ALIGN_DOWN(virt, size), size);
+        if (!(table[index] & VMM_HUGE))
+            defer_table_tree(get_table(table, index), child_level, &flush->deferred);
+    }
+    set_entry(table, index, phys | flags | VMM_HUGE);
+}
+
+static inline bool can_map_huge(uint64_t virt, uint64_t phys, uint64_t end, uint64_t size)
+{
+    return (virt % size) == 0 && (phys % size) == 0 && end - virt >= size;
+}
+
+/* Exclusive end of [virt, virt + size), clamped instead of wrapping to 0 for ranges that reach the top */
+static inline uint64_t range_end(uint64_t virt, uint64_t size)
+{
+    if (size > ALIGN_DOWN(UINT64_MAX, PAGE_SIZE) - virt)
+        return UINT64_MAX;
+    return virt + ALIGN_UP(size, PAGE_SIZE);
+}
+
+/* Moves virt up to the next step boundary, false if that would wrap past the top */
+static inline bool next_boundary(uint64_t *virt, uint64_t step)
+{
+    uint64_t next = ALIGN_DOWN(*virt, step) + step;
+    if (next <= *virt)
+        return false;
+    *virt = next;
+    return true;
+}
+
+static inline uint64_t huge_phys(uint64_t entry, uint64_t virt, uint64_t size)
+{
+    return (entry & PAGE_MASK & ~(size - 1)) + (virt & (size - 1) & ~(PAGE_SIZE - 1));
+}
+
+/*
+ * Walks down to `virt` and frees tables left empty on the way back up. The pages are only queued
+ * on `deferred`: other CPUs may still be walking them until the shootdown for the unmap is done.
+ */
+static void reclaim_tables(uint64_t *pagemap, uint64_t virt, page_t **deferred)
+{
+    /*
+     * Kernel-half tables are walked under every PCID, and the small-range shootdown's invlpg only
+     * drops the paging-structure caches of the current one. Another PCID could keep a pointer to a
+     * freed table, so those stay for good.
+     */
+    if (!VMM_RECLAIM_TABLES || virt >= VMM_KERNEL_HALF)
+        return;
+
+    uint64_t *tables[4] = {pagemap, NULL, NULL, NULL};
+    uint64_t indices[3];
+    const uint64_t shifts[3] = {PML4_SHIFT, PML3_SHIFT, PML2_SHIFT};
+    int depth = 0;
+    while (depth < 3)
+    {
+        indices[depth] = page_index(virt, shifts[depth]);
+        uint64_t entry = tables[depth][indices[depth]];
+        if (!(entry & VMM_PRESENT) || (entry & VMM_HUGE))
+            break;
+        tables[depth + 1] = get_table(tables[depth], indices[depth]);
+        depth++;
+    }
+
+    for (; depth >= 1; depth--)
+    {
+        if (*table_count(tables[depth]) != 0)
+            break;
+
+        set_entry(tables[depth - 1], indices[depth - 1], 0);
+        defer_table(tables[depth], deferred);
+    }
+}
+
+static void release_deferred(page_t *deferred)
+{
+    while (deferred)
+    {
+        page_t *next = deferred->next;
+        deferred->next = NULL;
+        release_table((uint64_t *)HIGHER_HALF(pmm_page_to_phys(deferred)));
+        deferred = next;
+    }
+}
+
+/* With the write lock dropped: one shootdown for everything queued, then the tables can go */
+static void flush_finish(uint64_t *pagemap, vmm_flush_t *flush)
+{
+    if (flush->end != flush->start)
+        tlb_shootdown(pagemap, flush->start, (flush->end - flush->start) / PAGE_SIZE);
+    release_deferred(flush->deferred);
+}
+
+/* Pagemap metadata */
+static inline uint64_t pagemap_bucket(uint64_t pml4)
+{
+    return (pml4 / PAGE_SIZE) % PAGEMAP_BUCKETS;
+}
+
+static bool pagemap_register(uint64_t *pagemap)
+{
+    vmm_pagemap_meta_t *meta = slab_alloc(pagemap_meta_cache);
+    if (meta == NULL)
+        return false;
+
+    memset(meta, 0, sizeof(vmm_pagemap_meta_t));
+    meta->pml4 = (uint64_t)PHYSICAL(pagemap);
+
+    uint64_t flags = spinlock_acquire_irqsave(&pagemap_lock);
+    uint64_t bucket = pagemap_bucket(meta->pml4);
+    meta->next = pagemap_buckets[bucket];
+    rcu_assign_pointer(pagemap_buckets[bucket], meta);
+    spinlock_release_irqrestore(&pagemap_lock, flags);
+    return true;
+}
+
+static void pagemap_meta_free(rcu_head_t *head)
+{
+    slab_free(pagemap_meta_cache, rcu_entry(head, vmm_pagemap_meta_t, rcu));
+}
+
+static void pagemap_unregister(uint64_t *pagemap)
+{
+    uint64_t pml4 = (uint64_t)PHYSICAL(pagemap);
+
+    uint64_t flags = spinlock_acquire_irqsave(&pagemap_lock);
+    vmm_pagemap_meta_t **link = &pagemap_buckets[pagemap_bucket(pml4)];
+    while (*link && (*link)->pml4 != pml4)
+        link = &(*link)->next;
+
+    vmm_pagemap_meta_t *meta = *link;
+    if (meta)
+        rcu_assign_pointer(*link, meta->next);
+    spinlock_release_irqrestore(&pagemap_lock, flags);
+
+    /* Lookups for other pagemaps in the same bucket may still be stepping through it */
+    if (meta)
+        call_rcu(&meta->rcu, pagemap_meta_free);
+}
+
+vmm_pagemap_meta_t *vmm_pagemap_meta(uint64_t *pagemap)
+{
+    uint64_t pml4 = (uint64_t)PHYSICAL(pagemap);
+    rcu_read_lock();
+    vmm_pagemap_meta_t *meta = rcu_dereference(pagemap_buckets[pagemap_bucket(pml4)]);
+    while (meta && meta->pml4 != pml4)
+        meta = rcu_dereference(meta->next);
+    rcu_read_unlock();
+    return meta; // lives as long as its pagemap, which the caller is holding on to
+}
+
+/*
+ * Table locks. Lookups take the read side, so translations on different cores never wait on each
+ * other. Anything that changes the table structure takes the write side, and drops it before its
+ * shootdown: a core spinning on the lock with interrupts off couldn't ack the flush IPI. Pagemaps
+ * without metadata (the bootloader's) aren't locked at all.
+ */
+static inline rwlock_t *tables_lock(uint64_t *pagemap, uint64_t virt)
+{
+    vmm_pagemap_meta_t *meta = virt >= VMM_KERNEL_HALF ? kernel_meta : vmm_pagemap_meta(pagemap);
+    return meta ? &meta->lock : NULL;
+}
+
+static inline uint64_t tables_read_acquire(rwlock_t *lock)
+{
+    return lock ? rwlock_read_acquire_irqsave(lock) : 0;
+}
+
+static inline void tables_read_release(rwlock_t *lock, uint64_t flags)
+{
+    if (lock)
+        rwlock_read_release_irqrestore(lock, flags);
+}
+
+static inline uint64_t tables_write_acquire(rwlock_t *lock)
+{
+    return lock ? rwlock_write_acquire_irqsave(lock) : 0;
+}
+
+static inline void tables_write_release(rwlock_t *lock, uint64_t flags)
+{
+    if (lock)
+        rwlock_write_release_irqrestore(lock, flags);
+}
+
 /* Translation */
-uint64_t virt_to_phys(uint64_t *pagemap, uint64_t virt)
+static uint64_t translate(uint64_t *pagemap, uint64_t virt)
 {
     uint64_t pml4_idx = page_index(virt, PML4_SHIFT);
     if (!(pagemap[pml4_idx] & VMM_PRESENT))
@@ -57,10 +380,15 @@ uint64_t virt_to_phys(uint64_t *pagemap, uint64_t virt)
     if (!(pml3[pml3_idx] & VMM_PRESENT))
         return 0;
 
+    if (pml3[pml3_idx] & VMM_HUGE)
+        return huge_phys(pml3[pml3_idx], virt, PAGE_SIZE_1G);
+
     uint64_t *pml2 = get_table(pml3, pml3_idx);
     uint64_t pml2_idx = page_index(virt, PML2_SHIFT);
     if (!(pml2[pml2_idx] & VMM_PRESENT))
         return 0;
+    if (pml2[pml2_idx] & VMM_HUGE)
+        return huge_phys(pml2[pml2_idx], virt, PAGE_SIZE_2M);
 
     uint64_t *pml1 = get_table(pml2, pml2_idx);
     uint64_t pml1_idx = page_index(virt, PML1_SHIFT);
@@ -70,57 +398,348 @@ uint64_t virt_to_phys(uint64_t *pagemap, uint64_t virt)
     return pml1[pml1_idx] & PAGE_MASK;
 }
 
-void vmm_map(uint64_t *pagemap, uint64_t virt, uint64_t phys, uint64_t flags)
+uint64_t virt_to_phys(uint64_t *pagemap, uint64_t virt)
+{
+    rwlock_t *lock = tables_lock(pagemap, virt);
+    uint64_t flags = tables_read_acquire(lock);
+    uint64_t phys = translate(pagemap, virt);
+    tables_read_release(lock, flags);
+    return phys;
+}
+
+bool vmm_map(uint64_t *pagemap, uint64_t virt, uint64_t phys, uint64_t flags)
+{
+    return vmm_map_size(pagemap, virt, phys, flags & ~VMM_HUGE, PAGE_SIZE);
+}
+
+static bool map_size(uint64_t *pagemap, uint64_t virt, uint64_t phys, uint64_t flags, uint64_t size, vmm_flush_t *flush)
 {
+    if (size == PAGE_SIZE_1G && !huge_1g_supported)
+    {
+        /* No 1 GiB pages on this CPU, fall back to 2 MiB ones */
+        for (uint64_t off = 0; off < PAGE_SIZE_1G; off += PAGE_SIZE_2M)
+        {
+            if (!map_size(pagemap, virt + off, phys + off, flags, PAGE_SIZE_2M, flush))
+                return false;
+        }
+        return true;
+    }
+
     uint64_t pml4_idx = page_index(virt, PML4_SHIFT);
     uint64_t pml3_idx = page_index(virt, PML3_SHIFT);
     uint64_t pml2_idx = page_index(virt, PML2_SHIFT);
     uint64_t pml1_idx = page_index(virt, PML1_SHIFT);
 
-    uint64_t *pml3 = get_or_alloc_table(pagemap, pml4_idx, flags);
-    uint64_t *pml2 = get_or_alloc_table(pml3, pml3_idx, flags);
-    uint64_t *pml1 = get_or_alloc_table(pml2, pml2_idx, flags);
+    uint64_t *pml3 = get_or_alloc_table(pagemap, pml4_idx, virt, flags, 0, flush);
+    if (pml3 == NULL)
+        return false;
+    if (size == PAGE_SIZE_1G)
+    {
+        set_huge(pml3, pml3_idx, virt, phys, flags, 2, flush);
+        return true;
+    }
 
-    pml1[pml1_idx] = phys | flags;
+    uint64_t *pml2 = get_or_alloc_table(pml3, pml3_idx, virt, flags, PAGE_SIZE_1G, flush);
+    if (pml2 == NULL)
+        return false;
+    if (size == PAGE_SIZE_2M)
+    {
+        set_huge(pml2, pml2_idx, virt, phys, flags, 1, flush);
+        return true;
+    }
+
+    uint64_t *pml1 = get_or_alloc_table(pml2, pml2_idx, virt, flags, PAGE_SIZE_2M, flush);
+    if (pml1 == NULL)
+        return false;
+
+    if (pml1[pml1_idx] & VMM_PRESENT)
+        flush_add(flush, virt, PAGE_SIZE);
+    set_entry(pml1, pml1_idx, phys | flags);
+    return true;
 }
 
-void vmm_unmap(uint64_t *pagemap, uint64_t virt)
+/* False if a page table couldn't be allocated, the mapping is then left out */
+bool vmm_map_size(uint64_t *pagemap, uint64_t virt, uint64_t phys, uint64_t flags, uint64_t size)
+{
+    if (virt >= VMM_KERNEL_HALF)
+        flags |= VMM_GLOBAL;
+
+    vmm_flush_t flush = {0};
+    rwlock_t *lock = tables_lock(pagemap, virt);
+    uint64_t irq = tables_write_acquire(lock);
+    bool mapped = map_size(pagemap, virt, phys, flags, size, &flush);
+    tables_write_release(lock, irq);
+    flush_finish(pagemap, &flush);
+    return mapped;
+}
+
+/*
+ * Maps one 4 KiB page unless something already covers virt, for callers that may race to fill it.
+ * Returns 1 if it mapped the page, 0 if someone else got there first, -1 if out of memory.
+ */
+int vmm_map_if_unmapped(uint64_t *pagemap, uint64_t virt, uint64_t phys, uint64_t flags)
+{
+    if (virt >= VMM_KERNEL_HALF)
+        flags |= VMM_GLOBAL;
+
+    vmm_flush_t flush = {0};
+    rwlock_t *lock = tables_lock(pagemap, virt);
+    uint64_t irq = tables_write_acquire(lock);
+    int result = 0;
+    if (translate(pagemap, virt) == 0)
+        result = map_size(pagemap, virt, phys, flags & ~VMM_HUGE, PAGE_SIZE, &flush) ? 1 : -1;
+    tables_write_release(lock, irq);
+    flush_finish(pagemap, &flush);
+    return result;
+}
+
+/* Clears the PML1 entry for virt, returns false if nothing was mapped there or a huge page couldn't be split */
+static bool unmap_page(uint64_t *pagemap, uint64_t virt, vmm_flush_t *flush)
 {
     uint64_t pml4_idx = page_index(virt, PML4_SHIFT);
     if (!(pagemap[pml4_idx] & VMM_PRESENT))
-        return;
+        return false;
 
     uint64_t *pml3 = get_table(pagemap, pml4_idx);
     uint64_t pml3_idx = page_index(virt, PML3_SHIFT);
     if (!(pml3[pml3_idx] & VMM_PRESENT))
-        return;
+        return false;
+    if ((pml3[pml3_idx] & VMM_HUGE) && !split_huge(pml3, pml3_idx, virt, PAGE_SIZE_1G, flush))
+    {
+        err("Out of memory splitting the huge page at 0x%.16llx, it stays mapped", virt);
+        return false;
+    }
 
     uint64_t *pml2 = get_table(pml3, pml3_idx);
     uint64_t pml2_idx = page_index(virt, PML2_SHIFT);
     if (!(pml2[pml2_idx] & VMM_PRESENT))
-        return;
+        return false;
+    if ((pml2[pml2_idx] & VMM_HUGE) && !split_huge(pml2, pml2_idx, virt, PAGE_SIZE_2M, flush))
+    {
+        err("Out of memory splitting the huge page at 0x%.16llx, it stays mapped", virt);
+        return false;
+    }
 
     uint64_t *pml1 = get_table(pml2, pml2_idx);
     uint64_t pml1_idx = page_index(virt, PML1_SHIFT);
 
-    pml1[pml1_idx] = 0;
-    __asm__ volatile("invlpg (%0)" ::"r"(virt) : "memory");
+    if (!(pml1[pml1_idx] & VMM_PRESENT))
+        return false;
+
+    set_entry(pml1, pml1_idx, 0);
+    flush_add(flush, virt, PAGE_SIZE);
+    reclaim_tables(pagemap, virt, &flush->deferred);
+    return true;
+}
+
+void vmm_unmap(uint64_t *pagemap, uint64_t virt)
+{
+    vmm_flush_t flush = {0};
+    rwlock_t *lock = tables_lock(pagemap, virt);
+    uint64_t flags = tables_write_acquire(lock);
+    unmap_page(pagemap, virt, &flush);
+    tables_write_release(lock, flags);
+    flush_finish(pagemap, &flush);
+}
+
+/*
+ * Range versions: each table on the way down is looked up once per range instead of once
+ * per page, and huge pages are used wherever virt, phys and the remaining length line up.
+ */
+/* False if a page table couldn't be allocated, whatever got mapped before that stays mapped */
+bool vmm_map_range(uint64_t *pagemap, uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags)
+{
+    uint64_t end = range_end(virt, size);
+    flags &= ~VMM_HUGE;
+    if (virt >= VMM_KERNEL_HALF)
+        flags |= VMM_GLOBAL; // shared by every pagemap, so one invlpg covers all PCIDs
+
+    vmm_flush_t flush = {0};
+    bool ok = true;
+    rwlock_t *lock = tables_lock(pagemap, virt);
+    uint64_t irq = tables_write_acquire(lock);
+    while (ok && virt < end)
+    {
+        uint64_t *pml3 = get_or_alloc_table(pagemap, page_index(virt, PML4_SHIFT), virt, flags, 0, &flush);
+        if (pml3 == NULL)
+        {
+            ok = false;
+            break;
+        }
+        do
+        {
+            uint64_t pml3_idx = page_index(virt, PML3_SHIFT);
+            if (huge_1g_supported && can_map_huge(virt, phys, end, PAGE_SIZE_1G))
+            {
+                set_huge(pml3, pml3_idx, virt, phys, flags, 2, &flush);
+                virt += PAGE_SIZE_1G;
+                phys += PAGE_SIZE_1G;
+                continue;
+            }
+
+            uint64_t *pml2 = get_or_alloc_table(pml3, pml3_idx, virt, flags, PAGE_SIZE_1G, &flush);
+            if (pml2 == NULL)
+            {
+                ok = false;
+                break;
+            }
+            do
+            {
+                uint64_t pml2_idx = page_index(virt, PML2_SHIFT);
+                if (can_map_huge(virt, phys, end, PAGE_SIZE_2M))
+                {
+                    set_huge(pml2, pml2_idx, virt, phys, flags, 1, &flush);
+                    virt += PAGE_SIZE_2M;
+                    phys += PAGE_SIZE_2M;
+                    continue;
+                }
+
+                uint64_t *pml1 = get_or_alloc_table(pml2, pml2_idx, virt, flags, PAGE_SIZE_2M, &flush);
+                if (pml1 == NULL)
+                {
+                    ok = false;
+                    break;
+                }
+                for (uint64_t i = page_index(virt, PML1_SHIFT); i < 512 && virt < end; i++)
+                {
+                    if (pml1[i] & VMM_PRESENT)
+                        flush_add(&flush, virt, PAGE_SIZE);
+                    set_entry(pml1, i, phys | flags);
+                    virt += PAGE_SIZE;
+                    phys += PAGE_SIZE;
+                }
+            } while (ok && virt < end && page_index(virt, PML2_SHIFT) != 0);
+        } while (ok && virt < end && page_index(virt, PML3_SHIFT) != 0);
+
+        if (virt == 0)
+            break; // mapped the last page of the address space and wrapped
+    }
+    tables_write_release(lock, irq);
+    flush_finish(pagemap, &flush);
+
+    if (!ok)
+        err("Out of memory for page tables mapping 0x%.16llx", virt);
+    return ok;
+}
+
+void vmm_unmap_range(uint64_t *pagemap, uint64_t virt, uint64_t size)
+{
+    uint64_t start = virt;
+    uint64_t end = range_end(virt, size);
+    bool cleared = false;
+    vmm_flush_t flush = {0};
+
+    rwlock_t *lock = tables_lock(pagemap, virt);
+    uint64_t flags = tables_write_acquire(lock);
+    while (virt < end)
+    {
+        uint64_t pml4_idx = page_index(virt, PML4_SHIFT);
+        if (!(pagemap[pml4_idx] & VMM_PRESENT))
+        {
+            if (!next_boundary(&virt, 1ULL << PML4_SHIFT))
+                break;
+            continue;
+        }
+
+        uint64_t *pml3 = get_table(pagemap, pml4_idx);
+        uint64_t pml3_idx = page_index(virt, PML3_SHIFT);
+        if (!(pml3[pml3_idx] & VMM_PRESENT))
+        {
+            if (!next_boundary(&virt, PAGE_SIZE_1G))
+                break;
+            continue;
+        }
+        if (pml3[pml3_idx] & VMM_HUGE)
+        {
+            if (can_map_huge(virt, 0, end, PAGE_SIZE_1G))
+            {
+                set_entry(pml3, pml3_idx, 0);
+                reclaim_tables(pagemap, virt, &flush.deferred);
+                cleared = true;
+                if (!next_boundary(&virt, PAGE_SIZE_1G))
+                    break;
+                continue;
+            }
+            if (!split_huge(pml3, pml3_idx, virt, PAGE_SIZE_1G, &flush))
+            {
+                err("Out of memory splitting the huge page at 0x%.16llx, it stays mapped", virt);
+                if (!next_boundary(&virt, PAGE_SIZE_1G))
+                    break;
+                continue;
+            }
+        }
+
+        uint64_t *pml2 = get_table(pml3, pml3_idx);
+        uint64_t pml2_idx = page_index(virt, PML2_SHIFT);
+        if (!(pml2[pml2_idx] & VMM_PRESENT))
+        {
+            if (!next_boundary(&virt, PAGE_SIZE_2M))
+                break;
+            continue;
+        }
+        if (pml2[pml2_idx] & VMM_HUGE)
+        {
+            if (can_map_huge(virt, 0, end, PAGE_SIZE_2M))
+            {
+                set_entry(pml2, pml2_idx, 0);
+                reclaim_tables(pagemap, virt, &flush.deferred);
+                cleared = true;
+                if (!next_boundary(&virt, PAGE_SIZE_2M))
+                    break;
+                continue;
+            }
+            if (!split_huge(pml2, pml2_idx, virt, PAGE_SIZE_2M, &flush))
+            {
+                err("Out of memory splitting the huge page at 0x%.16llx, it stays mapped", virt);
+                if (!next_boundary(&virt, PAGE_SIZE_2M))
+                    break;
+                continue;
+            }
+        }
+
+        uint64_t *pml1 = get_table(pml2, pml2_idx);
+        uint64_t chunk = virt;
+        for (uint64_t i = page_index(virt, PML1_SHIFT); i < 512 && virt < end; i++)
+        {
+            cleared |= (pml1[i] & VMM_PRESENT) != 0;
+            set_entry(pml1, i, 0);
+            virt += PAGE_SIZE;
+        }
+        reclaim_tables(pagemap, chunk, &flush.deferred);
+        if (virt == 0)
+            break; // cleared the last page of the address space and wrapped
+    }
+    tables_write_release(lock, flags);
+
+    /* One shootdown for the whole range, tlb decides between invlpg and a full flush */
+    if (cleared)
+        flush_add(&flush, start, end - start);
+    flush_finish(pagemap, &flush);
 }
 
 uint64_t *vmm_new_pagemap()
 {
-    uint64_t *pagemap = (uint64_t *)HIGHER_HALF(pmm_request_page());
-    if (pagemap == NULL)
+    void *page = pmm_request_zeroed_page();
+    if (page == NULL)
     {
         err("Failed to allocate page for new pagemap.");
         return NULL;
     }
 
-    memset(pagemap, 0, PAGE_SIZE);
+    uint64_t *pagemap = (uint64_t *)HIGHER_HALF(page);
+    if (!pagemap_register(pagemap))
+    {
+        err("Failed to allocate metadata for new pagemap.");
+        pmm_release_pages((void *)PHYSICAL(pagemap), 1);
+        return NULL;
+    }
 
     if (kernel_pagemap)
     {
+        rwlock_t *lock = tables_lock(kernel_pagemap, VMM_KERNEL_HALF);
+        uint64_t flags = tables_read_acquire(lock);
         memcpy(pagemap + 256, kernel_pagemap + 256, 256 * sizeof(uint64_t));
+        tables_read_release(lock, flags);
     }
     else
     {
@@ -140,25 +759,245 @@ void vmm_destroy_pagemap(uint64_t *pagemap)
         warn("Tried to destroy pagemap at address 0, skipping");
         return;
     }
+    if ((read_cr3() & PAGE_MASK) == (uint64_t)PHYSICAL(pagemap))
+    {
+        err("Tried to destroy the active pagemap at 0x%.16llx, skipping", (uint64_t)pagemap);
+        return;
+    }
+
+    /*
+     * The lower half is private to this pagemap, the upper half is the kernel's and shared. Its
+     * PCID isn't handed out again before a generation change, which flushes every CPU anyway.
+     */
+    uint64_t before = table_pages;
+    page_t *deferred = NULL;
+    for (uint64_t i = 0; i < 256; i++)
+    {
+        if (pagemap[i] & VMM_PRESENT)
+            defer_table_tree(get_table(pagemap, i), 3, &deferred);
+    }
+    release_deferred(deferred);
+
+    pagemap_unregister(pagemap);
     pmm_release_pages((void *)PHYSICAL(pagemap), 1);
-    warn("Destroyed pagemap at 0x%.16llx", (uint64_t)pagemap);
+    warn("Destroyed pagemap at 0x%.16llx, freed %llu page table pages", (uint64_t)pagemap, before - table_pages + 1);
+}
+
+/*
+ * Copies one level of the lower half. Tables are duplicated, RAM leaves are shared: writable ones
+ * turn read-only + COW in both pagemaps and every shared page takes a reference. MMIO is mapped
+ * as-is. Huge leaves get split first so a later write fault only has to copy 4 KiB.
+ */
+static bool clone_table(uint64_t *src, uint64_t *dst, int level, uint64_t entries, uint64_t virt, vmm_flush_t *flush)
+{
+    uint64_t span = 1ULL << (PML1_SHIFT + 9 * (level - 1)); // bytes covered by one entry
+
+    for (uint64_t i = 0; i < entries; i++)
+    {
+        if (!(src[i] & VMM_PRESENT))
+            continue;
+
+        if (level > 1)
+        {
+            if ((src[i] & VMM_HUGE) && !split_huge(src, i, virt + i * span, span, flush))
+                return false;
+
+            uint64_t *child = alloc_table();
+            if (child == NULL)
+                return false;
+            set_entry(dst, i, (uint64_t)PHYSICAL(child) | (src[i] & ~PAGE_MASK));
+            if (!clone_table(get_table(src, i), child, level - 1, 512, virt + i * span, flush))
+                return false;
+            continue;
+        }
+
+        /* Device and uncached memory must keep going to the device, only PMM-managed RAM is shared */
+        if (!pmm_is_ram(src[i] & PAGE_MASK) || (src[i] & (VMM_PCD | VMM_PWT)))
+        {
+            set_entry(dst, i, src[i]);
+            continue;
+        }
+
+        if (src[i] & VMM_WRITE)
+            src[i] = (src[i] & ~VMM_WRITE) | VMM_COW;
+        pmm_page_ref(src[i] & PAGE_MASK);
+        set_entry(dst, i, src[i]);
+    }
+    return true;
+}
+
+/* Drops the refs a half-done clone took, the tables themselves go with vmm_destroy_pagemap */
+static void unref_clone(uint64_t *table, int level, uint64_t entries)
+{
+    for (uint64_t i = 0; i < entries; i++)
+    {
+        if (!(table[i] & VMM_PRESENT))
+            continue;
+
+        if (level > 1)
+            unref_clone(get_table(table, i), level - 1, 512);
+        else if (pmm_is_ram(table[i] & PAGE_MASK) && !(table[i] & (VMM_PCD | VMM_PWT)))
+            pmm_page_unref(table[i] & PAGE_MASK);
+    }
+}
+
+/* Fork-style copy: the new pagemap shares every lower-half page with the source until one writes */
+uint64_t *vmm_clone_pagemap(uint64_t *pagemap)
+{
+    uint64_t *clone = vmm_new_pagemap();
+    if (clone == NULL)
+        return NULL;
+
+    /*
+     * The source loses write access everywhere, but other CPUs keep writing through their cached
+     * entries until the shootdown is done. A COW fault resolved before then would copy a page that
+     * is still changing, so vmm_handle_cow waits on cow_flushes. It can't just be done under the
+     * lock: a CPU spinning on it with interrupts off couldn't ack the flush.
+     */
+    uint64_t before = table_pages;
+    vmm_flush_t flush = {0};
+    vmm_pagemap_meta_t *meta = vmm_pagemap_meta(pagemap);
+    rwlock_t *lock = tables_lock(pagemap, 0);
+    uint64_t flags = tables_write_acquire(lock);
+    if (meta)
+        __atomic_add_fetch(&meta->cow_flushes, 1, __ATOMIC_RELAXED);
+    bool ok = clone_table(pagemap, clone, 4, 256, 0, &flush);
+    tables_write_release(lock, flags);
+
+    flush_add(&flush, 0, 256ULL << PML4_SHIFT);
+    flush_finish(pagemap, &flush);
+    if (meta)
+        __atomic_sub_fetch(&meta->cow_flushes, 1, __ATOMIC_RELEASE);
+
+    /* The source keeps its COW entries, a fault on a page nobody else holds just makes it writable again */
+    if (!ok)
+    {
+        err("Out of memory cloning pagemap 0x%.16llx", (uint64_t)pagemap);
+        unref_clone(clone, 4, 256);
+        vmm_destroy_pagemap(clone);
+        return NULL;
+    }
+
+    info("Cloned pagemap 0x%.16llx into 0x%.16llx, %llu page table pages", (uint64_t)pagemap, (uint64_t)clone, table_pages - before);
+    return clone;
+}
+
+/* Returns the PML1 entry mapping virt, or NULL if there isn't one */
+static uint64_t *find_pte(uint64_t *pagemap, uint64_t virt)
+{
+    uint64_t *table = pagemap;
+    for (uint64_t shift = PML4_SHIFT; shift > PML1_SHIFT; shift -= 9)
+    {
+        uint64_t entry = table[page_index(virt, shift)];
+        if (!(entry & VMM_PRESENT) || (entry & VMM_HUGE))
+            return NULL;
+        table = get_table(table, page_index(virt, shift));
+    }
+    return &table[page_index(virt, PML1_SHIFT)];
+}
+
+/* Resolves a write fault on a COW page, returns false if the page was never COW in the first place */
+static int resolve_cow(uint64_t *pagemap, uint64_t virt)
+{
+    uint64_t *pte = find_pte(pagemap, virt);
+    if (pte == NULL || !(*pte & VMM_PRESENT))
+        return -1;
+    if (*pte & VMM_WRITE)
+        return 0; // someone else resolved it, this CPU was looking at a stale entry
+    if (!(*pte & VMM_COW))
+        return -1;
+
+    uint64_t old = *pte & PAGE_MASK;
+    uint64_t flags = (*pte & ~PAGE_MASK & ~VMM_COW) | VMM_WRITE;
+    if (!pmm_page_shared(old))
+    {
+        /* Every other owner already copied or unmapped it, this one can just have it back */
+        *pte = old | flags;
+    }
+    else
+    {
+        void *page = pmm_request_page();
+        if (page == NULL)
+        {
+            err("Out of memory copying COW page at 0x%.16llx", virt);
+            return -1;
+        }
+
+        memcpy(HIGHER_HALF(page), HIGHER_HALF(old), PAGE_SIZE);
+        *pte = (uint64_t)page | flags;
+        if (pmm_page_unref(old))
+            pmm_release_pages((void *)old, 1); // the last sharer let go while we were copying
+    }
+    return 1;
+}
+
+bool vmm_handle_cow(uint64_t *pagemap, uint64_t virt)
+{
+    virt = ALIGN_DOWN(virt, PAGE_SIZE);
+    vmm_pagemap_meta_t *meta = virt < VMM_KERNEL_HALF ? vmm_pagemap_meta(pagemap) : NULL;
+    rwlock_t *lock = tables_lock(pagemap, virt);
+    uint64_t flags;
+    for (;;)
+    {
+        flags = tables_write_acquire(lock);
+        if (meta == NULL || __atomic_load_n(&meta->cow_flushes, __ATOMIC_ACQUIRE) == 0)
+            break;
+        tables_write_release(lock, flags);
+
+        /* The clone may be waiting on this CPU, and faults can arrive with interrupts off */
+        tlb_poll();
+        __asm__ volatile("pause");
+    }
+    int result = resolve_cow(pagemap, virt); // -1 not COW, 0 already writable, 1 replaced
+    tables_write_release(lock, flags);
+
+    if (result > 0)
+        tlb_shootdown(pagemap, virt, 1);
+    return result >= 0;
 }
 
 void vmm_switch_pagemap(uint64_t *new_pagemap)
 {
-    __asm__ volatile("movq %0, %%cr3" ::"r"(PHYSICAL((uint64_t)new_pagemap)));
+    uint64_t flags = int_save_disable();
+    write_cr3(tlb_switch_pagemap(new_pagemap));
+    int_restore(flags);
 }
 
 /* Initialization */
+static void map_section(uint64_t start, uint64_t end, uint64_t kvirt, uint64_t kphys, uint64_t flags)
+{
+    start = ALIGN_DOWN(start, PAGE_SIZE);
+    end = ALIGN_UP(end, PAGE_SIZE);
+    vmm_map_range(kernel_pagemap, start, start - kvirt + kphys, end - start, flags);
+}
+
 void vmm_init()
 {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001)
+    {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        huge_1g_supported = (edx & BIT(26)) != 0;
+    }
+    mem("1 GiB pages %s", huge_1g_supported ? "supported" : "not supported, using 2 MiB pages");
+
+    tlb_cpu_setup();
+
+    pagemap_meta_cache = slab_cache_create("pagemap_meta", sizeof(vmm_pagemap_meta_t), 0, NULL);
     kernel_pagemap = (uint64_t *)pmm_request_pages(1, true);
-    if (kernel_pagemap == NULL)
+    if (kernel_pagemap == NULL || pagemap_meta_cache == NULL)
     {
         info("error: Failed to allocate page for kernel pagemap, halting");
         hcf();
     }
     memset(kernel_pagemap, 0, PAGE_SIZE);
+    if (!pagemap_register(kernel_pagemap))
+    {
+        info("error: Failed to allocate kernel pagemap metadata, halting");
+        hcf();
+    }
+    kernel_meta = vmm_pagemap_meta(kernel_pagemap);
 
     uint64_t kvirt = kernel_address_request.response->virtual_base;
     uint64_t kphys = kernel_address_request.response->physical_base;
@@ -167,37 +1006,22 @@ void vmm_init()
     PRINT_SECTION("rodata", __rodata_start, __rodata_end);
     PRINT_SECTION("data", __data_start, __data_end);
 
-    kernel_stack_top = ALIGN_UP(kernel_stack_top, PAGE_SIZE);
-    for (uint64_t stack = kernel_stack_top - (16 * 1024); stack < kernel_stack_top; stack += PAGE_SIZE)
-    {
-        vmm_map(kernel_pagemap, stack, (uint64_t)PHYSICAL(stack), VMM_PRESENT | VMM_WRITE | VMM_NX);
-    }
-    mem("Mapped kernel stack");
-
-    for (uint64_t reqs = ALIGN_DOWN(__limine_requests_start, PAGE_SIZE); reqs < ALIGN_UP(__limine_requests_end, PAGE_SIZE); reqs += PAGE_SIZE)
-    {
-        vmm_map(kernel_pagemap, reqs, reqs - kvirt + kphys, VMM_PRESENT | VMM_WRITE);
-    }
+    map_section((uint64_t)__limine_requests_start, (uint64_t)__limine_requests_end, kvirt, kphys, VMM_PRESENT | VMM_WRITE);
     mem("Mapped Limine Requests region.");
 
-    for (uint64_t text = ALIGN_DOWN(__text_start, PAGE_SIZE); text < ALIGN_UP(__text_end, PAGE_SIZE); text += PAGE_SIZE)
-    {
-        vmm_map(kernel_pagemap, text, text - kvirt + kphys, VMM_PRESENT);
-    }
+    map_section((uint64_t)__text_start, (uint64_t)__text_end, kvirt, kphys, VMM_PRESENT);
     mem("Mapped .text");
 
-    for (uint64_t rodata = ALIGN_DOWN(__rodata_start, PAGE_SIZE); rodata < ALIGN_UP(__rodata_end, PAGE_SIZE); rodata += PAGE_SIZE)
-    {
-        vmm_map(kernel_pagemap, rodata, rodata - kvirt + kphys, VMM_PRESENT | VMM_NX);
-    }
+    map_section((uint64_t)__rodata_start, (uint64_t)__rodata_end, kvirt, kphys, VMM_PRESENT | VMM_NX);
     mem("Mapped .rodata");
 
-    for (uint64_t data = ALIGN_DOWN(__data_start, PAGE_SIZE); data < ALIGN_UP(__data_end, PAGE_SIZE); data += PAGE_SIZE)
-    {
-        vmm_map(kernel_pagemap, data, data - kvirt + kphys, VMM_PRESENT | VMM_WRITE | VMM_NX);
-    }
+    map_section((uint64_t)__data_start, (uint64_t)__data_end, kvirt, kphys, VMM_PRESENT | VMM_WRITE | VMM_NX);
     mem("Mapped .data");
 
+    vmm_map_range(kernel_pagemap, (uint64_t)HIGHER_HALF(0), 0, 0x100000000, VMM_PRESENT | VMM_WRITE);
+    mem("Mapped HHDM");
+
+    /* The first 4 GiB are already covered, only map what's above that */
     if (memmap_request.response)
     {
         struct limine_memmap_response *memmap = memmap_request.response;
@@ -206,20 +1030,32 @@ void vmm_init()
             struct limine_memmap_entry *entry = memmap->entries[i];
             uint64_t base = ALIGN_DOWN(entry->base, PAGE_SIZE);
             uint64_t end = ALIGN_UP(entry->base + entry->length, PAGE_SIZE);
+            if (end <= 0x100000000)
+                continue;
+            if (base < 0x100000000)
+                base = 0x100000000;
 
-            for (uint64_t addr = base; addr < end; addr += PAGE_SIZE)
-            {
-                vmm_map(kernel_pagemap, (uint64_t)HIGHER_HALF(addr), addr, VMM_PRESENT | VMM_WRITE | VMM_NX);
-            }
+            vmm_map_range(kernel_pagemap, (uint64_t)HIGHER_HALF(base), base, end - base, VMM_PRESENT | VMM_WRITE | VMM_NX);
             mem("Mapped memory map entry %d: base=0x%.16llx, length=0x%.16llx, type=%d", i, entry->base, entry->length, entry->type);
         }
     }
 
-    for (uint64_t gb4 = 0; gb4 < 0x100000000; gb4 += PAGE_SIZE)
+    /* pmm_init moved its entry's base past the PMM metadata, which may itself sit above 4 GiB */
+    uint64_t meta_base, meta_length;
+    pmm_get_metadata(&meta_base, &meta_length);
+    if (meta_base + meta_length > 0x100000000)
     {
-        vmm_map(kernel_pagemap, (uint64_t)HIGHER_HALF(gb4), gb4, VMM_PRESENT | VMM_WRITE);
+        uint64_t base = meta_base < 0x100000000 ? 0x100000000 : meta_base;
+        vmm_map_range(kernel_pagemap, (uint64_t)HIGHER_HALF(base), base, meta_base + meta_length - base, VMM_PRESENT | VMM_WRITE | VMM_NX);
+        mem("Mapped PMM metadata: base=0x%.16llx, length=0x%.16llx", meta_base, meta_length);
     }
-    mem("Mapped HHDM");
+
+    /* Done after the HHDM so the stack gets its own NX 4 KiB pages */
+    kernel_stack_top = ALIGN_UP(kernel_stack_top, PAGE_SIZE);
+    for (uint64_t stack = kernel_stack_top - (16 * 1024); stack < kernel_stack_top; stack += PAGE_SIZE)
+        vmm_map(kernel_pagemap, stack, (uint64_t)PHYSICAL(stack), VMM_PRESENT | VMM_WRITE | VMM_NX);
+    mem("Mapped kernel stack");
+    mem("Kernel pagemap uses %llu page table pages", table_pages + 1);
 
     vmm_switch_pagemap(kernel_pagemap);
 }
\ No newline at end of file
@@ -0,0 +1,86 @@
+#define LOG_MODULE "acpi"
+#include <sys/acpi.h>
+#include <boot/boot.h>
+#include <lib/string.h>
+#include <util/log.h>
+#include <util/memory.h>
+
+static acpi_sdt_header_t *root_table = NULL;
+static bool use_xsdt = false;
+
+static bool checksum_ok(void *table, size_t length)
+{
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++)
+        sum += ((uint8_t *)table)[i];
+    return sum == 0;
+}
+
+void acpi_init(void)
+{
+    if (rsdp_request.response == NULL || rsdp_request.response->address == 0)
+    {
+        warn("No RSDP from the bootloader, ACPI tables unavailable");
+        return;
+    }
+
+    acpi_rsdp_t *rsdp = (acpi_rsdp_t *)HIGHER_HALF(rsdp_request.response->address);
+    if (memcmp(rsdp->signature, "RSD PTR ", 8) != 0 || !checksum_ok(rsdp, 20))
+    {
+        err("Invalid RSDP at 0x%.16llx", rsdp_request.response->address);
+        return;
+    }
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_address != 0)
+    {
+        root_table = (acpi_sdt_header_t *)HIGHER_HALF(rsdp->xsdt_address);
+        use_xsdt = true;
+    }
+    else
+    {
+        root_table = (acpi_sdt_header_t *)HIGHER_HALF((uint64_t)rsdp->rsdt_address);
+        use_xsdt = false;
+    }
+
+    if (!checksum_ok(root_table, root_table->length))
+    {
+        err("%s checksum mismatch, ignoring ACPI tables", use_xsdt ? "XSDT" : "RSDT");
+        root_table = NULL;
+        return;
+    }
+
+    info("ACPI revision %d, using %s @ 0x%.16llx", rsdp->revision, use_xsdt ? "XSDT" : "RSDT", (uint64_t)root_table);
+}
+
+void *acpi_find_table(const char *signature)
+{
+    if (root_table == NULL)
+        return NULL;
+
+    size_t entry_size = use_xsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+    size_t entries = (root_table->length - sizeof(acpi_sdt_header_t)) / entry_size;
+    uint8_t *pointers = (uint8_t *)root_table + sizeof(acpi_sdt_header_t);
+
+    for (size_t i = 0; i < entries; i++)
+    {
+        uint64_t phys;
+        if (use_xsdt)
+        {
+            uint64_t value;
+            memcpy(&value, pointers + i * entry_size, sizeof(value));
+            phys = value;
+        }
+        else
+        {
+            uint32_t value;
+            memcpy(&value, pointers + i * entry_size, sizeof(value));
+            phys = value;
+        }
+
+        acpi_sdt_header_t *table = (acpi_sdt_header_t *)HIGHER_HALF(phys);
+        if (memcmp(table->signature, signature, 4) == 0 && checksum_ok(table, table->length))
+            return table;
+    }
+
+    return NULL;
+}
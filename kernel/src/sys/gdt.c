@@ -1,10 +1,8 @@
 #include <sys/gdt.h>
+#include <lib/string.h>
 
-gdt_entry_t gdt[7];
-gdt_ptr_t gdt_ptr;
-tss_entry_t tss; // Not used yet
-
-void gdt_init()
+/* Every CPU gets its own GDT since the TSS descriptor points at that CPU's TSS */
+void gdt_init(gdt_entry_t *gdt, tss_entry_t *tss)
 {
     gdt[0] = (gdt_entry_t){0, 0, 0, 0x00, 0x00, 0};                               // Null descriptor
     gdt[1] = (gdt_entry_t){0, 0, 0, GDT_KERNEL_CODE, GDT_GRANULARITY_FLAT, 0};    // Kernel code segment
@@ -12,10 +10,18 @@ void gdt_init()
     gdt[3] = (gdt_entry_t){0, 0, 0, GDT_USER_CODE, GDT_GRANULARITY_LONG_MODE, 0}; // User code segment
     gdt[4] = (gdt_entry_t){0, 0, 0, GDT_USER_DATA, 0x00, 0};                      // User data segment
 
-    gdt_ptr.limit = (uint16_t)(sizeof(gdt) - 1);
-    gdt_ptr.base = (uint64_t)&gdt;
+    /* The TSS descriptor is 16 bytes and takes up entries 5 and 6 */
+    memset(tss, 0, sizeof(tss_entry_t));
+    tss->io_map_base = sizeof(tss_entry_t);
+    uint64_t base = (uint64_t)tss;
+    uint32_t limit = sizeof(tss_entry_t) - 1;
+    *(gdt_system_entry_t *)&gdt[5] = (gdt_system_entry_t){
+        limit & 0xFFFF, base & 0xFFFF, (base >> 16) & 0xFF, GDT_TSS, (limit >> 16) & 0x0F,
+        (base >> 24) & 0xFF, base >> 32, 0};
 
+    gdt_ptr_t gdt_ptr = {(uint16_t)(sizeof(gdt_entry_t) * GDT_ENTRIES - 1), (uint64_t)gdt};
     gdt_flush(gdt_ptr);
+    __asm__ volatile("ltr %w0" : : "r"(GDT_TSS_SELECTOR) : "memory");
 }
 
 void gdt_flush(gdt_ptr_t gdt_ptr)
@@ -36,5 +42,5 @@ void gdt_flush(gdt_ptr_t gdt_ptr)
         "mov %%ax, %%fs\n"
         :
         : "r"(&gdt_ptr)
-        : "memory");
-}
\ No newline at end of file
+        : "rax", "rdi", "memory");
+}
@@ -3,10 +3,12 @@
 #include <lib/string.h>
 #include <stdarg.h>
 #include <sys/cpu.h>
+#include <sys/rcu.h>
+#include <sys/smp.h>
 #include <util/log.h>
 
 struct idt_entry __attribute__((aligned(16))) idt_descriptor[256] = {0};
-idt_intr_handler real_handlers[256] = {0};
+static idt_intr_handler real_handlers[256] = {0};
 extern uint64_t stubs[];
 
 struct __attribute__((packed)) idt_ptr
@@ -195,12 +197,59 @@ void load_idt()
         : : "m"(idt_ptr) : "memory");
 }
 
-int idt_register_handler(size_t vector, idt_intr_handler handler)
+/*
+ * Common entry from the stubs, hardware interrupts are counted so locks and such can tell they're in
+ * one. The handler table is read without a lock: hardware interrupts run with interrupts off, which
+ * already makes them RCU readers, exceptions take the read lock.
+ */
+void idt_dispatch(struct register_ctx *ctx)
 {
-    if (real_handlers[vector] != idt_default_interrupt_handler)
+    bool irq = ctx->vector >= IDT_IRQ_BASE;
+    bool was_idle = false;
+    if (irq)
+    {
+        cpu_local()->irq_depth++;
+        was_idle = rcu_irq_enter();
+    }
+    else
+    {
+        rcu_read_lock();
+    }
+
+    idt_intr_handler handler = rcu_dereference(real_handlers[ctx->vector]);
+    if (handler)
+        handler(ctx);
+    else
+        idt_default_interrupt_handler(ctx);
+
+    if (irq)
+    {
+        rcu_irq_exit(was_idle);
+        cpu_local()->irq_depth--;
+    }
+    else
     {
-        real_handlers[vector] = handler;
-        return 0;
+        rcu_read_unlock();
     }
-    return 1;
+}
+
+int idt_register_handler(size_t vector, idt_intr_handler handler)
+{
+    /* Free slots and the default exception handler can be taken, anything else is already owned */
+    idt_intr_handler current = __atomic_load_n(&real_handlers[vector], __ATOMIC_ACQUIRE);
+    if (current != NULL && current != idt_default_interrupt_handler)
+        return 1;
+    return __atomic_compare_exchange_n(&real_handlers[vector], &current, handler, false, __ATOMIC_RELEASE,
+                                       __ATOMIC_RELAXED) ? 0 : 1;
+}
+
+/* Once this returns no CPU is still inside `handler` for this vector, so whatever it used can go */
+int idt_unregister_handler(size_t vector, idt_intr_handler handler)
+{
+    idt_intr_handler fallback = vector < IDT_IRQ_BASE ? idt_default_interrupt_handler : NULL;
+    if (!__atomic_compare_exchange_n(&real_handlers[vector], &handler, fallback, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        return 1;
+
+    synchronize_rcu();
+    return 0;
 }
\ No newline at end of file
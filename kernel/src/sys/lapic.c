@@ -0,0 +1,76 @@
+#define LOG_MODULE "lapic"
+#include <sys/lapic.h>
+#include <sys/cpu.h>
+#include <sys/idt.h>
+#include <mm/vmm.h>
+#include <util/log.h>
+#include <util/memory.h>
+
+#define IA32_APIC_BASE_MSR 0x1B
+#define IA32_APIC_BASE_ENABLE BIT(11)
+
+#define LAPIC_REG_ID 0x20
+#define LAPIC_REG_EOI 0xB0
+#define LAPIC_REG_SVR 0xF0
+#define LAPIC_REG_ICR_LOW 0x300
+#define LAPIC_REG_ICR_HIGH 0x310
+
+#define LAPIC_SVR_ENABLE BIT(8)
+#define LAPIC_ICR_PENDING BIT(12)
+#define LAPIC_ICR_ASSERT BIT(14)
+
+static volatile uint32_t *lapic_regs = NULL;
+
+static inline uint32_t lapic_read(uint32_t reg)
+{
+    return lapic_regs[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value)
+{
+    lapic_regs[reg / 4] = value;
+}
+
+static void lapic_spurious_handler(struct register_ctx *ctx)
+{
+    (void)ctx; // Spurious interrupts don't get an EOI
+}
+
+void lapic_init()
+{
+    uint64_t phys = rdmsr(IA32_APIC_BASE_MSR) & PAGE_MASK;
+
+    /* The HHDM maps this as write-back, registers need an uncached 4 KiB mapping */
+    lapic_regs = (volatile uint32_t *)HIGHER_HALF(phys);
+    vmm_map(kernel_pagemap, (uint64_t)lapic_regs, phys, VMM_PRESENT | VMM_WRITE | VMM_NX | VMM_PCD | VMM_PWT);
+
+    idt_register_handler(LAPIC_SPURIOUS_VECTOR, lapic_spurious_handler);
+    lapic_init_cpu();
+    info("Local APIC at 0x%.16llx enabled, id %u", phys, lapic_id());
+}
+
+/* Every core has its own APIC at the same physical address, so APs only need to switch theirs on */
+void lapic_init_cpu()
+{
+    wrmsr(IA32_APIC_BASE_MSR, rdmsr(IA32_APIC_BASE_MSR) | IA32_APIC_BASE_ENABLE);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+uint32_t lapic_id()
+{
+    return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+void lapic_eoi()
+{
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector)
+{
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING)
+        __asm__ volatile("pause");
+
+    lapic_write(LAPIC_REG_ICR_HIGH, lapic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, LAPIC_ICR_ASSERT | vector);
+}
@@ -0,0 +1,224 @@
+#define LOG_MODULE "numa"
+#include <sys/numa.h>
+#include <sys/acpi.h>
+#include <sys/cpu.h>
+#include <util/log.h>
+#include <util/memory.h>
+
+#define SRAT_PROCESSOR_AFFINITY 0
+#define SRAT_MEMORY_AFFINITY 1
+#define SRAT_X2APIC_AFFINITY 2
+#define SRAT_ENABLED BIT(0)
+#define SRAT_MAX_LAPICS 256
+
+typedef struct srat
+{
+    acpi_sdt_header_t header;
+    uint32_t reserved0;
+    uint64_t reserved1;
+} __attribute__((packed)) srat_t;
+
+typedef struct srat_entry
+{
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) srat_entry_t;
+
+typedef struct srat_processor_affinity
+{
+    srat_entry_t header;
+    uint8_t domain_low;
+    uint8_t lapic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_high[3];
+    uint32_t clock_domain;
+} __attribute__((packed)) srat_processor_affinity_t;
+
+typedef struct srat_memory_affinity
+{
+    srat_entry_t header;
+    uint32_t domain;
+    uint16_t reserved0;
+    uint32_t base_low;
+    uint32_t base_high;
+    uint32_t length_low;
+    uint32_t length_high;
+    uint32_t reserved1;
+    uint32_t flags;
+    uint64_t reserved2;
+} __attribute__((packed)) srat_memory_affinity_t;
+
+typedef struct srat_x2apic_affinity
+{
+    srat_entry_t header;
+    uint16_t reserved0;
+    uint32_t domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved1;
+} __attribute__((packed)) srat_x2apic_affinity_t;
+
+typedef struct lapic_affinity
+{
+    uint32_t lapic_id;
+    uint32_t node;
+} lapic_affinity_t;
+
+static numa_memory_range_t ranges[NUMA_MAX_RANGES];
+static uint32_t range_count = 0;
+static uint32_t domains[NUMA_MAX_NODES];
+static uint32_t node_count = 1;
+static lapic_affinity_t lapics[SRAT_MAX_LAPICS];
+static uint32_t lapic_count = 0;
+static uint32_t cpu_nodes[CPU_MAX];
+
+/* Proximity domains can be sparse, nodes are handed out densely in SRAT order */
+static uint32_t domain_to_node(uint32_t domain)
+{
+    for (uint32_t i = 0; i < node_count; i++)
+    {
+        if (domains[i] == domain)
+            return i;
+    }
+
+    if (node_count == NUMA_MAX_NODES)
+    {
+        warn("Too many proximity domains, folding domain %d into node 0", domain);
+        return 0;
+    }
+
+    domains[node_count] = domain;
+    return node_count++;
+}
+
+static void add_range(uint64_t base, uint64_t length, uint32_t node)
+{
+    if (range_count == NUMA_MAX_RANGES)
+    {
+        warn("Too many SRAT memory ranges, dropping 0x%.16llx", base);
+        return;
+    }
+
+    /* Keep the list sorted by base */
+    uint32_t i = range_count++;
+    while (i > 0 && ranges[i - 1].base > base)
+    {
+        ranges[i] = ranges[i - 1];
+        i--;
+    }
+    ranges[i] = (numa_memory_range_t){base, length, node};
+}
+
+static void add_lapic(uint32_t lapic_id, uint32_t node)
+{
+    if (lapic_count < SRAT_MAX_LAPICS)
+        lapics[lapic_count++] = (lapic_affinity_t){lapic_id, node};
+}
+
+static uint32_t current_lapic_id(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0xB)
+    {
+        cpuid(0xB, 0, &eax, &ebx, &ecx, &edx);
+        return edx;
+    }
+
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    return ebx >> 24;
+}
+
+void numa_init(void)
+{
+    srat_t *srat = acpi_find_table("SRAT");
+    if (srat == NULL)
+    {
+        info("No SRAT, treating memory as a single node");
+        return;
+    }
+
+    /* Node 0 is always whatever domain shows up first */
+    node_count = 0;
+
+    uint8_t *cursor = (uint8_t *)srat + sizeof(srat_t);
+    uint8_t *end = (uint8_t *)srat + srat->header.length;
+    while (cursor + sizeof(srat_entry_t) <= end)
+    {
+        srat_entry_t *entry = (srat_entry_t *)cursor;
+        if (entry->length == 0)
+            break;
+
+        if (entry->type == SRAT_MEMORY_AFFINITY)
+        {
+            srat_memory_affinity_t *m = (srat_memory_affinity_t *)entry;
+            uint64_t base = ((uint64_t)m->base_high << 32) | m->base_low;
+            uint64_t length = ((uint64_t)m->length_high << 32) | m->length_low;
+            if ((m->flags & SRAT_ENABLED) && length != 0)
+                add_range(base, length, domain_to_node(m->domain));
+        }
+        else if (entry->type == SRAT_PROCESSOR_AFFINITY)
+        {
+            srat_processor_affinity_t *p = (srat_processor_affinity_t *)entry;
+            uint32_t domain = p->domain_low | ((uint32_t)p->domain_high[0] << 8) |
+                              ((uint32_t)p->domain_high[1] << 16) | ((uint32_t)p->domain_high[2] << 24);
+            if (p->flags & SRAT_ENABLED)
+                add_lapic(p->lapic_id, domain_to_node(domain));
+        }
+        else if (entry->type == SRAT_X2APIC_AFFINITY)
+        {
+            srat_x2apic_affinity_t *x = (srat_x2apic_affinity_t *)entry;
+            if (x->flags & SRAT_ENABLED)
+                add_lapic(x->x2apic_id, domain_to_node(x->domain));
+        }
+
+        cursor += entry->length;
+    }
+
+    if (node_count == 0)
+        node_count = 1;
+
+    for (uint32_t i = 0; i < range_count; i++)
+        mem("Node %d: 0x%.16llx -> 0x%.16llx", ranges[i].node, ranges[i].base, ranges[i].base + ranges[i].length);
+    info("%d NUMA node(s), %d memory range(s), %d CPU affinities", node_count, range_count, lapic_count);
+
+    numa_register_cpu(cpu_current_id(), current_lapic_id());
+}
+
+void numa_register_cpu(uint32_t cpu, uint32_t lapic_id)
+{
+    if (cpu >= CPU_MAX)
+        return;
+
+    cpu_nodes[cpu] = 0;
+    for (uint32_t i = 0; i < lapic_count; i++)
+    {
+        if (lapics[i].lapic_id == lapic_id)
+        {
+            cpu_nodes[cpu] = lapics[i].node;
+            break;
+        }
+    }
+}
+
+uint32_t numa_node_count(void)
+{
+    return node_count;
+}
+
+uint32_t numa_range_count(void)
+{
+    return range_count;
+}
+
+const numa_memory_range_t *numa_get_range(uint32_t index)
+{
+    return index < range_count ? &ranges[index] : NULL;
+}
+
+uint32_t numa_node_of_cpu(uint32_t cpu)
+{
+    return cpu < CPU_MAX ? cpu_nodes[cpu] : 0;
+}
@@ -0,0 +1,189 @@
+#define LOG_MODULE "rcu"
+#include <sys/rcu.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+#include <sys/spinlock.h>
+#include <util/log.h>
+#include <util/memory.h>
+
+typedef struct
+{
+    rcu_head_t *head;
+    rcu_head_t **tail;
+} rcu_list_t;
+
+/*
+ * Grace periods are numbered. Starting one snapshots the online CPUs into `waiting_cpus`, each
+ * clears its own bit at its next quiescent state and whoever clears the last one ends it. Idle
+ * CPUs can't be in a read-side section, so they're dropped from the snapshot right away and never
+ * have to wake up for it.
+ *
+ * Callbacks move through three batches: `next_cbs` collects new ones while a grace period is
+ * running, the next start turns them into `wait_cbs`, and its end hands them to `done_cbs`, which
+ * the idle loops run outside interrupt context.
+ */
+static spinlock_t rcu_lock = {0};
+static uint64_t gp_seq = 0;  // last grace period started
+static uint64_t gp_done = 0; // last grace period completed
+static bool gp_wanted = false; // synchronize_rcu needs one more after the current
+static uint64_t waiting_cpus = 0;
+static rcu_list_t next_cbs = {NULL, &next_cbs.head};
+static rcu_list_t wait_cbs = {NULL, &wait_cbs.head};
+static rcu_list_t done_cbs = {NULL, &done_cbs.head};
+
+static void list_splice(rcu_list_t *to, rcu_list_t *from)
+{
+    if (from->head == NULL)
+        return;
+
+    *to->tail = from->head;
+    to->tail = from->tail;
+    from->head = NULL;
+    from->tail = &from->head;
+}
+
+static void gp_start(void);
+
+/* rcu_lock held, called exactly once per grace period by whoever cleared the last bit */
+static void gp_end(void)
+{
+    __atomic_store_n(&gp_done, gp_seq, __ATOMIC_RELEASE);
+    list_splice(&done_cbs, &wait_cbs);
+    if (next_cbs.head || gp_wanted)
+        gp_start();
+}
+
+/* rcu_lock held, no grace period running */
+static void gp_start(void)
+{
+    gp_seq++;
+    gp_wanted = false;
+    list_splice(&wait_cbs, &next_cbs);
+
+    uint64_t mask = 0;
+    for (uint32_t i = 0; i < CPU_MAX; i++)
+    {
+        cpu_local_t *cpu = smp_cpu(i);
+        if (cpu && __atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE))
+            mask |= BIT(i);
+    }
+    __atomic_store_n(&waiting_cpus, mask, __ATOMIC_SEQ_CST);
+
+    /* Pairs with rcu_idle_enter: either we see the CPU idle here or it sees its bit in rcu_qs */
+    for (uint32_t i = 0; i < CPU_MAX; i++)
+    {
+        if (!(mask & BIT(i)) || !__atomic_load_n(&smp_cpu(i)->rcu_idle, __ATOMIC_SEQ_CST))
+            continue;
+        if (__atomic_fetch_and(&waiting_cpus, ~BIT(i), __ATOMIC_SEQ_CST) == BIT(i))
+        {
+            gp_end();
+            return;
+        }
+    }
+}
+
+void rcu_qs(void)
+{
+    uint64_t bit = BIT(cpu_current_id());
+    if (!(__atomic_load_n(&waiting_cpus, __ATOMIC_SEQ_CST) & bit))
+        return;
+    if (__atomic_fetch_and(&waiting_cpus, ~bit, __ATOMIC_SEQ_CST) != bit)
+        return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&rcu_lock);
+    gp_end();
+    spinlock_release_irqrestore(&rcu_lock, flags);
+}
+
+/* From the timer interrupt: the code it landed on was quiescent unless it was reading or handling something */
+void rcu_tick(void)
+{
+    cpu_local_t *cpu = cpu_local();
+    if (cpu->rcu_nesting == 0 && cpu->irq_depth == 1)
+        rcu_qs();
+}
+
+void rcu_idle_enter(void)
+{
+    __atomic_store_n(&cpu_local()->rcu_idle, true, __ATOMIC_SEQ_CST);
+    rcu_qs();
+}
+
+void rcu_idle_exit(void)
+{
+    __atomic_store_n(&cpu_local()->rcu_idle, false, __ATOMIC_SEQ_CST);
+}
+
+/* An interrupt out of hlt: reads in the handler count, so the CPU stops being idle until it returns */
+bool rcu_irq_enter(void)
+{
+    cpu_local_t *cpu = cpu_local();
+    if (!__atomic_load_n(&cpu->rcu_idle, __ATOMIC_RELAXED))
+        return false;
+    __atomic_store_n(&cpu->rcu_idle, false, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+void rcu_irq_exit(bool was_idle)
+{
+    if (was_idle)
+        rcu_idle_enter();
+}
+
+void call_rcu(rcu_head_t *head, void (*func)(rcu_head_t *head))
+{
+    head->func = func;
+    head->next = NULL;
+
+    uint64_t flags = spinlock_acquire_irqsave(&rcu_lock);
+    *next_cbs.tail = head;
+    next_cbs.tail = &head->next;
+    if (gp_done == gp_seq)
+        gp_start();
+    spinlock_release_irqrestore(&rcu_lock, flags);
+}
+
+void synchronize_rcu(void)
+{
+    /* A grace period already running may have started before the caller's update, wait for the next */
+    uint64_t flags = spinlock_acquire_irqsave(&rcu_lock);
+    uint64_t target = gp_seq + 1;
+    if (gp_done == gp_seq)
+        gp_start();
+    else
+        gp_wanted = true;
+    spinlock_release_irqrestore(&rcu_lock, flags);
+
+    /* The caller isn't reading anything, so it reports for itself instead of waiting on a tick */
+    while (__atomic_load_n(&gp_done, __ATOMIC_ACQUIRE) < target)
+    {
+        rcu_qs();
+        __asm__ volatile("pause" ::: "memory");
+    }
+}
+
+/* Whether rcu_process_callbacks has anything to run, for idle loops deciding to sleep */
+bool rcu_callbacks_ready(void)
+{
+    return __atomic_load_n(&done_cbs.head, __ATOMIC_RELAXED) != NULL;
+}
+
+/* Runs whatever finished its grace period, from the idle loops where callbacks can take locks freely */
+void rcu_process_callbacks(void)
+{
+    if (__atomic_load_n(&done_cbs.head, __ATOMIC_RELAXED) == NULL)
+        return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&rcu_lock);
+    rcu_head_t *head = done_cbs.head;
+    done_cbs.head = NULL;
+    done_cbs.tail = &done_cbs.head;
+    spinlock_release_irqrestore(&rcu_lock, flags);
+
+    while (head)
+    {
+        rcu_head_t *next = head->next;
+        head->func(head);
+        head = next;
+    }
+}
@@ -0,0 +1,56 @@
+#include <sys/rwlock.h>
+#include <sys/smp.h>
+
+static inline uint32_t rwlock_wait_writer(rwlock_t *lock)
+{
+    uint32_t cnts;
+    while ((cnts = __atomic_load_n(&lock->cnts, __ATOMIC_ACQUIRE)) & RWLOCK_WRITER_LOCKED)
+        __asm__ volatile("pause" ::: "memory");
+    return cnts;
+}
+
+void rwlock_read_acquire_slow(rwlock_t *lock, uint32_t cnts)
+{
+    /* Our reader bias is already in, only an active writer can keep us out */
+    if (cpu_in_irq())
+    {
+        if (cnts & RWLOCK_WRITER_LOCKED)
+            rwlock_wait_writer(lock);
+        return;
+    }
+
+    /* Take the bias back out while queued so the writer ahead of us isn't waiting on it */
+    __atomic_sub_fetch(&lock->cnts, RWLOCK_READER, __ATOMIC_RELAXED);
+    spinlock_acquire(&lock->wait);
+
+    /* Head of the queue: put the bias back and wait for the writer in front to finish */
+    __atomic_add_fetch(&lock->cnts, RWLOCK_READER, __ATOMIC_ACQUIRE);
+    rwlock_wait_writer(lock);
+
+    /* Readers right behind us see LOCKED clear and get in without waiting on each other */
+    spinlock_release(&lock->wait);
+}
+
+void rwlock_write_acquire_slow(rwlock_t *lock)
+{
+    spinlock_acquire(&lock->wait);
+
+    uint32_t cnts = 0;
+    if (__atomic_compare_exchange_n(&lock->cnts, &cnts, RWLOCK_WRITER_LOCKED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        spinlock_release(&lock->wait);
+        return;
+    }
+
+    /* Stops new readers on the fast path, then wait for the ones already in to drain */
+    __atomic_fetch_or(&lock->cnts, RWLOCK_WRITER_WAITING, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        cnts = RWLOCK_WRITER_WAITING;
+        if (__atomic_compare_exchange_n(&lock->cnts, &cnts, RWLOCK_WRITER_LOCKED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        __asm__ volatile("pause" ::: "memory");
+    }
+
+    spinlock_release(&lock->wait);
+}
@@ -0,0 +1,201 @@
+#define LOG_MODULE "smp"
+#include <sys/smp.h>
+#include <boot/boot.h>
+#include <mm/pmm.h>
+#include <mm/tlb.h>
+#include <mm/vmm.h>
+#include <sys/idt.h>
+#include <sys/lapic.h>
+#include <sys/numa.h>
+#include <sys/rcu.h>
+#include <sys/spinlock.h>
+#include <util/log.h>
+#include <util/memory.h>
+#include <stddef.h>
+
+#define IA32_EFER 0xC0000080
+#define IA32_GS_BASE 0xC0000101
+#define EFER_NXE BIT(11)
+
+/* How long the BSP waits on the APs before carrying on without the missing ones */
+#define SMP_START_SPINS (1ULL << 28)
+
+_Static_assert(offsetof(cpu_local_t, id) == CPU_LOCAL_ID_OFFSET, "cpu_current_id() reads the wrong offset");
+
+static cpu_local_t cpu_locals[CPU_MAX];
+static uint32_t cpu_count = 1;
+static uint32_t cpus_online = 1;
+static spinlock_t call_lock = {0};
+
+/* Loading the GDT reloads GS, which zeroes its base, so the MSR has to be written after */
+static void cpu_local_load(cpu_local_t *cpu)
+{
+    gdt_init(cpu->gdt, &cpu->tss);
+    cpu->tss.rsp0 = cpu->stack_top;
+    wrmsr(IA32_GS_BASE, (uint64_t)cpu);
+}
+
+void smp_bsp_init(uint64_t stack_top)
+{
+    cpu_local_t *bsp = &cpu_locals[0];
+    bsp->self = bsp;
+    bsp->id = 0;
+    bsp->stack_top = stack_top;
+    bsp->online = true;
+    cpu_local_load(bsp);
+}
+
+[[noreturn]] static void ap_main(cpu_local_t *cpu)
+{
+    cpu_local_load(cpu);
+    load_idt();
+
+    /* Limine doesn't promise the BSP's EFER on the APs, and every kernel mapping relies on NX */
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+    if (edx & BIT(20))
+        wrmsr(IA32_EFER, rdmsr(IA32_EFER) | EFER_NXE);
+
+    tlb_cpu_setup();
+    vmm_switch_pagemap(kernel_pagemap);
+    lapic_init_cpu();
+    tlb_register_cpu(cpu->id, cpu->lapic_id);
+
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&cpus_online, 1, __ATOMIC_RELEASE);
+
+    /* No scheduler yet, APs sleep until smp_call hands them something */
+    for (;;)
+    {
+        rcu_process_callbacks();
+        __asm__ volatile("cli");
+        smp_work_t work = __atomic_load_n(&cpu->work, __ATOMIC_ACQUIRE);
+        if (work == NULL)
+        {
+            /* sti only takes effect after the next instruction, so a wakeup can't slip in before hlt */
+            rcu_idle_enter();
+            __asm__ volatile("sti\n\thlt" ::: "memory");
+            rcu_idle_exit();
+            continue;
+        }
+
+        void *arg = cpu->work_arg;
+        __atomic_store_n(&cpu->work, NULL, __ATOMIC_RELEASE);
+        __asm__ volatile("sti");
+        work(arg);
+        rcu_qs(); // the closest thing to a context switch there is for now
+    }
+}
+
+static void smp_wake_handler(struct register_ctx *ctx)
+{
+    (void)ctx;
+    lapic_eoi();
+}
+
+/* Limine's AP stack sits in bootloader memory, get off it before doing anything else */
+static void ap_entry(struct limine_mp_info *info)
+{
+    cpu_local_t *cpu = (cpu_local_t *)info->extra_argument;
+    __asm__ volatile(
+        "movq %0, %%rsp\n\t"
+        "xorq %%rbp, %%rbp\n\t"
+        "call *%2"
+        :
+        : "r"(cpu->stack_top), "D"(cpu), "r"(ap_main)
+        : "memory");
+    __builtin_unreachable();
+}
+
+void smp_init()
+{
+    cpu_local_t *bsp = &cpu_locals[0];
+    bsp->lapic_id = lapic_id();
+    bsp->node = numa_node_of_cpu(0);
+
+    struct limine_mp_response *mp = mp_request.response;
+    if (mp == NULL)
+    {
+        warn("No MP response from the bootloader, running on the BSP only");
+        return;
+    }
+
+    if (idt_register_handler(SMP_WAKE_VECTOR, smp_wake_handler) != 0)
+    {
+        err("Failed to register the wakeup handler, running on the BSP only");
+        return;
+    }
+
+    for (uint64_t i = 0; i < mp->cpu_count; i++)
+    {
+        struct limine_mp_info *info = mp->cpus[i];
+        if (info->lapic_id == mp->bsp_lapic_id)
+            continue;
+        if (cpu_count >= CPU_MAX)
+        {
+            warn("%llu CPUs reported, only %u are supported", mp->cpu_count, CPU_MAX);
+            break;
+        }
+
+        cpu_local_t *cpu = &cpu_locals[cpu_count];
+        cpu->self = cpu;
+        cpu->id = cpu_count;
+        cpu->lapic_id = info->lapic_id;
+        numa_register_cpu(cpu->id, cpu->lapic_id);
+        cpu->node = numa_node_of_cpu(cpu->id);
+
+        /* Node-local stack, the AP will be the only one touching it */
+        void *stack = pmm_request_pages_node(SMP_STACK_PAGES, true, cpu->node);
+        if (stack == NULL)
+        {
+            err("Failed to allocate a stack for lapic %u, leaving it parked", cpu->lapic_id);
+            continue;
+        }
+        cpu->stack_top = (uint64_t)stack + SMP_STACK_PAGES * PAGE_SIZE;
+        cpu_count++;
+
+        info->extra_argument = (uint64_t)cpu;
+        __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_RELEASE);
+    }
+
+    for (uint64_t spins = 0; __atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE) < cpu_count && spins < SMP_START_SPINS; spins++)
+        __asm__ volatile("pause");
+
+    uint32_t online = __atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE);
+    if (online < cpu_count)
+        warn("%u of %u APs never came online", cpu_count - online, cpu_count - 1);
+    info("%u CPU(s) online, BSP lapic id %u", online, mp->bsp_lapic_id);
+}
+
+uint32_t smp_cpu_count()
+{
+    return __atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE);
+}
+
+cpu_local_t *smp_cpu(uint32_t id)
+{
+    return id < cpu_count ? &cpu_locals[id] : NULL;
+}
+
+/* Runs `work` on an idle AP, returns false if it's offline or still busy with something else */
+bool smp_call(uint32_t id, smp_work_t work, void *arg)
+{
+    if (id == 0 || id >= cpu_count || !__atomic_load_n(&cpu_locals[id].online, __ATOMIC_ACQUIRE))
+        return false;
+
+    /* Only callers race on the slot, the AP empties it without the lock */
+    cpu_local_t *cpu = &cpu_locals[id];
+    spinlock_acquire(&call_lock);
+    bool busy = __atomic_load_n(&cpu->work, __ATOMIC_ACQUIRE) != NULL;
+    if (!busy)
+    {
+        cpu->work_arg = arg;
+        __atomic_store_n(&cpu->work, work, __ATOMIC_RELEASE);
+    }
+    spinlock_release(&call_lock);
+    if (busy)
+        return false;
+
+    lapic_send_ipi(cpu->lapic_id, SMP_WAKE_VECTOR);
+    return true;
+}
@@ -0,0 +1,115 @@
+#define LOG_MODULE "lock"
+#include <sys/spinlock.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+#include <util/log.h>
+#include <util/memory.h>
+
+static mcs_node_t mcs_nodes[CPU_MAX][MCS_NODES_PER_CPU];
+static uint8_t mcs_used[CPU_MAX]; // bit per node, an interrupt can grab one mid-acquire so it's a CAS
+
+static mcs_node_t *mcs_node_get(void)
+{
+    uint32_t cpu = cpu_current_id();
+    uint8_t used = __atomic_load_n(&mcs_used[cpu], __ATOMIC_RELAXED);
+    for (;;)
+    {
+        uint32_t index = __builtin_ctz(~(uint32_t)used);
+        if (index >= MCS_NODES_PER_CPU)
+        {
+            crit("CPU %u is nested %u MCS locks deep", cpu, MCS_NODES_PER_CPU);
+            hcf();
+        }
+        if (__atomic_compare_exchange_n(&mcs_used[cpu], &used, used | (1 << index), false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return &mcs_nodes[cpu][index];
+    }
+}
+
+static void mcs_node_put(mcs_node_t *node)
+{
+    uint64_t index = node - &mcs_nodes[0][0];
+    __atomic_fetch_and(&mcs_used[index / MCS_NODES_PER_CPU], ~(1 << (index % MCS_NODES_PER_CPU)), __ATOMIC_RELAXED);
+}
+
+void mcs_lock_acquire(mcs_lock_t *lock)
+{
+    LOCK_DEBUG_ACQUIRE(lock, __builtin_return_address(0));
+    mcs_node_t *node = mcs_node_get();
+    node->next = NULL;
+    node->locked = 1;
+
+    mcs_node_t *prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    if (prev)
+    {
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+            __asm__ volatile("pause" ::: "memory");
+    }
+    lock->owner = node;
+}
+
+bool mcs_lock_try_acquire(mcs_lock_t *lock)
+{
+    LOCK_DEBUG_ACQUIRE(lock, __builtin_return_address(0));
+    if (__atomic_load_n(&lock->tail, __ATOMIC_RELAXED) != NULL)
+        return false;
+
+    mcs_node_t *node = mcs_node_get();
+    node->next = NULL;
+    node->locked = 1;
+
+    mcs_node_t *expected = NULL;
+    if (!__atomic_compare_exchange_n(&lock->tail, &expected, node, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        mcs_node_put(node);
+        return false;
+    }
+    lock->owner = node;
+    return true;
+}
+
+void mcs_lock_release(mcs_lock_t *lock)
+{
+    mcs_node_t *node = lock->owner;
+    mcs_node_t *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (next == NULL)
+    {
+        /* Nobody queued behind us, try to swing the tail back to empty */
+        mcs_node_t *expected = node;
+        if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+            mcs_node_put(node);
+            return;
+        }
+
+        /* Someone swapped themselves in but hasn't linked up yet */
+        while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+            __asm__ volatile("pause" ::: "memory");
+    }
+
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+    mcs_node_put(node);
+}
+
+#ifdef GENOA_LOCK_DEBUG
+#define LOCK_SEEN_IN_IRQ BIT(0)
+#define LOCK_SEEN_IRQS_ON BIT(1)
+#define LOCK_REPORTED BIT(2)
+
+void lock_debug_acquire(uint8_t *state, void *lock, void *site)
+{
+    uint64_t rflags;
+    __asm__ volatile("pushfq\n\tpopq %0" : "=r"(rflags));
+
+    uint8_t seen = (cpu_in_irq() ? LOCK_SEEN_IN_IRQ : 0) | ((rflags & BIT(9)) ? LOCK_SEEN_IRQS_ON : 0);
+    uint8_t old = __atomic_fetch_or(state, seen, __ATOMIC_RELAXED);
+    if (((old | seen) & (LOCK_SEEN_IN_IRQ | LOCK_SEEN_IRQS_ON)) != (LOCK_SEEN_IN_IRQ | LOCK_SEEN_IRQS_ON))
+        return;
+    if (__atomic_fetch_or(state, LOCK_REPORTED, __ATOMIC_RELAXED) & LOCK_REPORTED)
+        return;
+
+    warn("Lock 0x%.16llx is taken in interrupt handlers and with interrupts enabled, last from 0x%.16llx (%s), "
+         "use the irqsave variants",
+         (uint64_t)lock, (uint64_t)(site ? site : __builtin_return_address(0)), (seen & LOCK_SEEN_IN_IRQ) ? "interrupt" : "process");
+}
+#endif // GENOA_LOCK_DEBUG